@@ -49,10 +49,14 @@ endfunction()
 #                     useful if the source file is a text file and we want to use the file contents
 #                     as string. But the size variable holds size of the byte array without this
 #                     null byte.
+#   GZIP            - If specified the (minified) content is gzip compressed before embedding it,
+#                     falls back to the uncompressed content if gzip is not available.
+# The variable is an embedded_file holding the data, an ETag (hash of the uncompressed content)
+# and whether the data is gzip compressed.
 # Usage:
 #   bin2h(SOURCE_FILE "Logo.png" HEADER_FILE "Logo.h" VARIABLE_NAME "LOGO_PNG")
 function(BIN2H)
-    set(options APPEND NULL_TERMINATE)
+    set(options APPEND NULL_TERMINATE GZIP)
     set(oneValueArgs SOURCE_FILE VARIABLE_NAME HEADER_FILE)
     cmake_parse_arguments(BIN2H "${options}" "${oneValueArgs}" "" ${ARGN})
 
@@ -64,6 +68,23 @@ function(BIN2H)
         file(COPY_FILE ${BIN2H_SOURCE_FILE} ${minified_file})
     endif()
 
+    # the etag only changes if the content changes
+    file(SHA1 ${minified_file} contentHash)
+    string(SUBSTRING ${contentHash} 0 16 contentHash)
+
+    set(gzipped false)
+    if(BIN2H_GZIP)
+        set(gzip_file "${BIN2H_HEADER_FILE}.gz.tmp")
+        # -n omits name and timestamp so that the output is reproducible
+        execute_process(COMMAND gzip -9 -n -c ${minified_file} OUTPUT_FILE ${gzip_file} RESULT_VARIABLE res)
+        if (res EQUAL 0)
+            set(minified_file ${gzip_file})
+            set(gzipped true)
+        else()
+            message("Failed to gzip ${BIN2H_SOURCE_FILE}, embedding it uncompressed")
+        endif()
+    endif()
+
     # reads source file contents as hex string
     file(READ ${minified_file} hexString HEX)
     string(LENGTH ${hexString} hexStringLength)
@@ -89,10 +110,11 @@ function(BIN2H)
     # declares byte array and the length variables
     set(arrayDefinition "constexpr char ${BIN2H_VARIABLE_NAME}_ARRAY[]{ ${arrayValues} };")
 
+    set(fileDefinition "constexpr embedded_file ${BIN2H_VARIABLE_NAME}{{${BIN2H_VARIABLE_NAME}_ARRAY, ${arraySize}}, \"\\\"${contentHash}\\\"\", ${gzipped}};")
     if(BIN2H_APPEND)
-        file(APPEND ${BIN2H_HEADER_FILE} "${arrayDefinition}\nconstexpr std::string_view ${BIN2H_VARIABLE_NAME}{${BIN2H_VARIABLE_NAME}_ARRAY, ${arraySize}};\n")
+        file(APPEND ${BIN2H_HEADER_FILE} "${arrayDefinition}\n${fileDefinition}\n")
     else()
-        file(WRITE ${BIN2H_HEADER_FILE} "#include <string_view>\n${arrayDefinition}\nconstexpr std::string_view ${BIN2H_VARIABLE_NAME}{${BIN2H_VARIABLE_NAME}_ARRAY, ${arraySize}};\n")
+        file(WRITE ${BIN2H_HEADER_FILE} "#include <string_view>\nstruct embedded_file { std::string_view data; std::string_view etag; bool gzip; };\n${arrayDefinition}\n${fileDefinition}\n")
     endif()
 endfunction()
 
@@ -108,9 +130,9 @@ function(convert_files)
     foreach(file ${ARG_SOURCES})
         get_filename_component(filename ${file} NAME)
         if (fileCreated)
-            bin2h(SOURCE_FILE "${file}" HEADER_FILE "${ARG_HEADER_FILE}" VARIABLE_NAME "${filename}" APPEND)
+            bin2h(SOURCE_FILE "${file}" HEADER_FILE "${ARG_HEADER_FILE}" VARIABLE_NAME "${filename}" APPEND GZIP)
         else()
-            bin2h(SOURCE_FILE "${file}" HEADER_FILE "${ARG_HEADER_FILE}" VARIABLE_NAME "${filename}")
+            bin2h(SOURCE_FILE "${file}" HEADER_FILE "${ARG_HEADER_FILE}" VARIABLE_NAME "${filename}" GZIP)
         endif()
         set(fileCreated TRUE)
     endforeach()
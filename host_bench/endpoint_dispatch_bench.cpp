@@ -0,0 +1,186 @@
+/**
+ * Host benchmark of the endpoint dispatch of tcp_server: route_table lookup followed by the call of the endpoint,
+ * once through std::function with capturing page closures (as before) and once through plain function pointers
+ * (tcp_server::endpoint_callback). The routes are the ones of webserver_routes, webserver.h itself needs the pico sdk.
+ * Build and run from the repository root:
+ *   g++ -O2 -std=c++2b -Iinclude host_bench/endpoint_dispatch_bench.cpp -o endpoint_dispatch_bench && ./endpoint_dispatch_bench
+ * Code size of the endpoint table with its dispatch, compare the sizes of:
+ *   g++ -Os -std=c++2b -Iinclude -DSIZE_PROBE=1 -c host_bench/endpoint_dispatch_bench.cpp -o function.o && size function.o
+ *   g++ -Os -std=c++2b -Iinclude -DSIZE_PROBE=2 -c host_bench/endpoint_dispatch_bench.cpp -o pointer.o && size pointer.o
+ */
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <random>
+#include <string_view>
+#include <vector>
+
+#include "tcp_server/route_table.h"
+
+inline constexpr std::array routes{
+	route{http_method::GET, "/measurements"},
+	route{http_method::GET, "/measurement_events"},
+	route{http_method::GET, "/measurements.bin"},
+	route{http_method::GET, "/ws"},
+	route{http_method::GET, "/history"},
+	route{http_method::GET, "/flash_log"},
+	route{http_method::GET, "/logs"},
+	route{http_method::GET, "/discovered_wifis"},
+	route{http_method::GET, "/host_name"},
+	route{http_method::GET, "/ap_active"},
+	route{http_method::GET, "/user"},
+	route{http_method::GET, "/time"},
+	route{http_method::GET, "/"},
+	route{http_method::GET, "/index.html"},
+	route{http_method::GET, "/style.css"},
+	route{http_method::GET, "/internet.html"},
+	route{http_method::GET, "/overview.html"},
+	route{http_method::GET, "/settings.html"},
+	route{http_method::POST, "/set_log_level"},
+	route{http_method::POST, "/host_name"},
+	route{http_method::POST, "/ap_active"},
+	route{http_method::POST, "/wifi_connect"},
+	route{http_method::POST, "/login"},
+	route{http_method::PUT, "/set_password"},
+	route{http_method::PUT, "/time"},
+};
+using router = route_table<routes>;
+
+/** @brief stand in for tcp_server::message_buffer, the endpoints write a status line and a header */
+struct message {
+	http_method method{};
+	std::string_view path{};
+	std::array<char, 256> buffer{};
+	int size{};
+	void append(std::string_view s) {
+		int n = std::min<int>(s.size(), buffer.size() - size);
+		std::memcpy(buffer.data() + size, s.data(), n);
+		size += n;
+	}
+};
+
+constexpr std::string_view STATUS_OK{"200 OK"};
+constexpr std::string_view CONTENT_TYPE_HTML{"text/html"};
+constexpr std::string_view CONTENT_TYPE_CSS{"text/css"};
+constexpr std::string_view PAGE{"<html>page</html>"};
+
+static void write_page(std::string_view page, std::string_view status, std::string_view type, message &res) {
+	res.size = 0;
+	res.append("HTTP/1.1 ");
+	res.append(status);
+	res.append("\r\nContent-Type: ");
+	res.append(type);
+	res.append("\r\n\r\n");
+	res.append(page);
+}
+static void write_status(message &res) {
+	res.size = 0;
+	res.append("HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+}
+
+// before: std::function with the pages as capturing closures
+using function_callback = std::function<void(const message &request, message &response)>;
+static auto page_closure(std::string_view page, std::string_view status, std::string_view type = CONTENT_TYPE_HTML) {
+	return [page, status, type](const message &, message &res) { write_page(page, status, type, res); };
+}
+static std::array<function_callback, routes.size()> function_endpoints() {
+	std::array<function_callback, routes.size()> e{};
+	for (auto &f: e)
+		f = [](const message &, message &res) { write_status(res); };
+	for (int i = 12; i < 18; ++i)
+		e[i] = page_closure(PAGE, STATUS_OK, i == 14 ? CONTENT_TYPE_CSS: CONTENT_TYPE_HTML);
+	return e;
+}
+
+// now: plain function pointers, the pages are function templates
+using pointer_callback = void(*)(const message &request, message &response);
+template<const std::string_view &page, const std::string_view &status, const std::string_view &type = CONTENT_TYPE_HTML>
+void page_function(const message &, message &res) { write_page(page, status, type, res); }
+static std::array<pointer_callback, routes.size()> pointer_endpoints() {
+	std::array<pointer_callback, routes.size()> e{};
+	for (auto &f: e)
+		f = [](const message &, message &res) { write_status(res); };
+	for (int i = 12; i < 18; ++i)
+		e[i] = i == 14 ? page_function<PAGE, STATUS_OK, CONTENT_TYPE_CSS>: page_function<PAGE, STATUS_OK>;
+	return e;
+}
+
+template<typename T>
+static int dispatch(const T &endpoints, const message &req, message &res) {
+	int i = router::find(req.method, req.path);
+	if (i >= 0)
+		endpoints[i](req, res);
+	return res.size;
+}
+
+#if SIZE_PROBE == 1
+int probe(const message &req, message &res) {
+	static const auto endpoints = function_endpoints();
+	return dispatch(endpoints, req, res);
+}
+#elif SIZE_PROBE == 2
+int probe(const message &req, message &res) {
+	static const auto endpoints = pointer_endpoints();
+	return dispatch(endpoints, req, res);
+}
+#else
+
+static int allocations{};
+void* operator new(size_t size) {
+	++allocations;
+	if (void *p = std::malloc(size))
+		return p;
+	throw std::bad_alloc{};
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+int main() {
+	int before = allocations;
+	const auto functions = function_endpoints();
+	int function_allocations = allocations - before;
+	before = allocations;
+	const auto pointers = pointer_endpoints();
+	int pointer_allocations = allocations - before;
+	printf("heap allocations for the endpoint table: std::function %d, function pointer %d\n", function_allocations, pointer_allocations);
+
+	// requests spread over all routes, the static pages and the measurements are the most frequent ones
+	std::mt19937 g{1};
+	std::discrete_distribution<int> pick{{8, 1, 4, 1, 2, 1, 2, 1, 1, 1, 1, 1, 4, 4, 4, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1}};
+	std::vector<message> requests(4096);
+	for (message &m: requests) {
+		const route &r = routes[pick(g)];
+		m.method = r.method;
+		m.path = r.path;
+	}
+
+	int failures{};
+	message a{}, b{};
+	for (const message &m: requests) {
+		dispatch(functions, m, a);
+		dispatch(pointers, m, b);
+		failures += std::string_view{a.buffer.data(), size_t(a.size)} != std::string_view{b.buffer.data(), size_t(b.size)};
+	}
+
+	constexpr int ROUNDS{500};
+	size_t acc{};
+	const auto bench = [&](const char *name, const auto &endpoints) {
+		message res{};
+		auto t0 = std::chrono::steady_clock::now();
+		for (int r = 0; r < ROUNDS; ++r)
+			for (const message &m: requests)
+				acc += dispatch(endpoints, m, res);
+		auto t1 = std::chrono::steady_clock::now();
+		printf("%-18s %6.1f ns per request\n", name, std::chrono::duration<double, std::nano>(t1 - t0).count() / (double(ROUNDS) * requests.size()));
+	};
+	bench("std::function", functions);
+	bench("function pointer", pointers);
+	printf("%s (%zu)\n", failures ? "FAILED": "ok", acc);
+	return failures != 0;
+}
+#endif
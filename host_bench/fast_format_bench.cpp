@@ -0,0 +1,109 @@
+/**
+ * Host check and benchmark of fast_format against std::format (or {fmt} where the standard library has no <format>).
+ * Build and run from the repository root:
+ *   g++ -O2 -std=c++2b -Iinclude host_bench/fast_format_bench.cpp -o fast_format_bench && ./fast_format_bench
+ *   (with {fmt}: add -DFMT_HEADER_ONLY)
+ * Code size of a single 5 field call, compare the .text sizes of:
+ *   g++ -Os -std=c++2b -Iinclude -DSIZE_PROBE=1 -c host_bench/fast_format_bench.cpp -o fast.o && size fast.o
+ *   g++ -Os -std=c++2b -Iinclude -DSIZE_PROBE=2 -DFMT_HEADER_ONLY -c host_bench/fast_format_bench.cpp -o std.o && size std.o
+ */
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <string_view>
+#include <vector>
+
+#include "static_types.h"
+
+#if __has_include(<format>) && __cplusplus >= 202002L
+#include <format>
+#endif
+#if defined(__cpp_lib_format)
+namespace ref = std;
+#else
+#include <fmt/format.h>
+namespace ref = fmt;
+#endif
+
+#if SIZE_PROBE == 1
+static_string<128> s;
+int probe(float a, int b, unsigned long long n, const char *c) { s.clear(); return s.append_formatted("{:.2f} {} {:x} {} {}", a, b, n, c, a); }
+#elif SIZE_PROBE == 2
+char o[128];
+int probe(float a, int b, unsigned long long n, const char *c) { return ref::format_to_n(o, 128, "{:.2f} {} {:x} {} {}", a, b, n, c, a).size; }
+#else
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+static uint64_t cycles() { return __rdtsc(); }
+#else
+static uint64_t cycles() { return 0; }
+#endif
+
+static int failures{};
+static void expect(std::string_view got, std::string_view expected) {
+	if (got == expected)
+		return;
+	++failures;
+	printf("FAIL: '%.*s' != '%.*s'\n", int(got.size()), got.data(), int(expected.size()), expected.data());
+}
+
+int main() {
+	static_string<128> s;
+	// int64 boundary of the fixed point conversion, v * 10^decimals has to stay below 9.2e18
+	s.fill_formatted("{}", 9.1e12); expect(s.sv(), "9100000000000");
+	s.fill_formatted("{}", 9.3e12); expect(s.sv(), "9300000000000");
+	s.fill_formatted("{}", -5e14); expect(s.sv(), "-500000000000000");
+	s.fill_formatted("{:.6f}", 9.19e12); expect(s.sv(), "9190000000000.000000");
+	s.fill_formatted("{:.6f}", 9.3e12); expect(s.sv(), "9300000000000");
+	s.fill_formatted("{:.2f}", 9.1e16); expect(s.sv(), "91000000000000000.00");
+	s.fill_formatted("{:.0f}", 9.1e18); expect(s.sv(), "9100000000000000000");
+	s.fill_formatted("{:.0f}", 9.3e18); expect(s.sv(), "inf");
+	s.fill_formatted("{:.2f}", -1e30); expect(s.sv(), "-inf");
+	s.fill_formatted("{}", INT64_MIN); expect(s.sv(), "-9223372036854775808");
+	// negative values rounding to zero keep their sign
+	s.fill_formatted("{:.2f}", -0.001); expect(s.sv(), "-0.00");
+	s.fill_formatted("{:.0f}", -0.4f); expect(s.sv(), "-0");
+	s.fill_formatted("{}", -0.0); expect(s.sv(), "-0");
+	s.fill_formatted("{:.2f}", 0.001); expect(s.sv(), "0.00");
+
+	// same output as the reference for the values of the meter
+	std::mt19937 g{1};
+	std::uniform_real_distribution<float> d(-5000, 5000);
+	std::vector<float> values(100000);
+	for (float &v: values)
+		v = d(g);
+	char o[64];
+	for (float v: values) {
+		s.clear();
+		s.append_formatted("{:.2f}", v);
+		auto r = ref::format_to_n(o, sizeof(o), "{:.2f}", v);
+		expect(s.sv(), {o, size_t(r.size)});
+		s.clear();
+		s.append_formatted("{} {:x}", int(v * 1000), uint32_t(v * 1000));
+		r = ref::format_to_n(o, sizeof(o), "{} {:x}", int(v * 1000), uint32_t(v * 1000));
+		expect(s.sv(), {o, size_t(r.size)});
+	}
+
+	constexpr int ROUNDS{20};
+	size_t acc{};
+	const auto bench = [&](const char *name, auto &&f) {
+		auto t0 = std::chrono::steady_clock::now();
+		uint64_t c0 = cycles();
+		for (int r = 0; r < ROUNDS; ++r)
+			for (float v: values)
+				acc += f(v);
+		uint64_t c1 = cycles();
+		auto t1 = std::chrono::steady_clock::now();
+		double n = double(ROUNDS) * values.size();
+		printf("%-28s %6.1f ns %6.0f tsc cycles per value\n", name, std::chrono::duration<double, std::nano>(t1 - t0).count() / n, (c1 - c0) / n);
+	};
+	bench("fast_format {:.2f}", [&](float v) { s.clear(); return s.append_formatted("{:.2f}", v); });
+	bench("reference {:.2f}", [&](float v) { return ref::format_to_n(o, sizeof(o), "{:.2f}", v).size; });
+	bench("fast_format {} int", [&](float v) { s.clear(); return s.append_formatted("{}", int(v * 1000)); });
+	bench("reference {} int", [&](float v) { return ref::format_to_n(o, sizeof(o), "{}", int(v * 1000)).size; });
+	printf("%s (%zu)\n", failures ? "FAILED": "ok", acc);
+	return failures != 0;
+}
+#endif
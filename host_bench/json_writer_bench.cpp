@@ -0,0 +1,76 @@
+/**
+ * Host check and benchmark of the measurement json (json_writer) against formatting the same fields with
+ * std::format "{:.2f}" (or {fmt} where the standard library has no <format>), as the endpoint did before.
+ * Build and run from the repository root:
+ *   g++ -O2 -std=c++2b -Iinclude -Imodbus_layouts host_bench/json_writer_bench.cpp -o json_writer_bench && ./json_writer_bench
+ *   (with {fmt}: add -DFMT_HEADER_ONLY)
+ */
+#include <cstdio>
+#include <chrono>
+#include <random>
+#include <string_view>
+#include <vector>
+
+#include "measurement_json.h"
+
+#if __has_include(<format>) && __cplusplus >= 202002L
+#include <format>
+#endif
+#if defined(__cpp_lib_format)
+namespace ref = std;
+#else
+#include <fmt/format.h>
+namespace ref = fmt;
+#endif
+
+using values_t = mapped_registers<eastron_sunspec_mapping>;
+
+/** @brief reference serialization of the field table with the format library */
+static int reference_json(char *out, int cap, const values_t &m) {
+	char *p = out, *end = out + cap;
+	*p++ = '{';
+	for (size_t i = 0; i < measurement_json_fields.size(); ++i) {
+		float v = m.values[measurement_json::indices[i]];
+		p = ref::format_to_n(p, end - p, "{}\"{}\":{:.2f}", i ? "," : "", measurement_json_fields[i].key, v).out;
+	}
+	*p++ = '}';
+	return p - out;
+}
+
+int main() {
+	std::mt19937 g{1};
+	std::uniform_real_distribution<float> d(-5000, 5000);
+	std::vector<values_t> snapshots(1000);
+	for (auto &m: snapshots)
+		for (auto &v: m.values)
+			v = d(g);
+
+	int failures{};
+	static_string<4096> s{};
+	char o[4096];
+	for (const auto &m: snapshots) {
+		s.clear();
+		measurement_json json{m};
+		int size = json.append_to(s);
+		int ref_size = reference_json(o, sizeof(o), m);
+		if (size != json.size() || s.sv() != std::string_view{o, size_t(ref_size)}) {
+			if (failures++ < 3)
+				printf("FAIL:\n%.*s\n%.*s\n", s.size(), s.data(), ref_size, o);
+		}
+	}
+
+	constexpr int ROUNDS{200};
+	size_t acc{};
+	const auto bench = [&](const char *name, auto &&f) {
+		auto t0 = std::chrono::steady_clock::now();
+		for (int r = 0; r < ROUNDS; ++r)
+			for (const auto &m: snapshots)
+				acc += f(m);
+		auto t1 = std::chrono::steady_clock::now();
+		printf("%-22s %6.0f ns per object\n", name, std::chrono::duration<double, std::nano>(t1 - t0).count() / (double(ROUNDS) * snapshots.size()));
+	};
+	bench("json_writer", [&](const values_t &m) { s.clear(); measurement_json json{m}; return json.size() + json.append_to(s); });
+	bench("reference {:.2f}", [&](const values_t &m) { return reference_json(o, sizeof(o), m); });
+	printf("%s, %d of %zu objects differ (%zu)\n", failures ? "FAILED": "ok", failures, snapshots.size(), acc);
+	return failures != 0;
+}
@@ -0,0 +1,106 @@
+import argparse
+import socket
+import struct
+import threading
+import time
+
+parser = argparse.ArgumentParser(
+                    prog='ModbusLoadTest',
+                    description='Opens several modbus tcp connections to the meter, pipelines read requests and reports the latency per client')
+
+parser.add_argument('host', help='Address of the meter')
+parser.add_argument('-p', '--port', help='Modbus tcp port, default: 502', type=int, default=502)
+parser.add_argument('-u', '--unit', help='Unit id, default: 1', type=int, default=1)
+parser.add_argument('-c', '--clients', help='Number of parallel connections, default: 8', type=int, default=8)
+parser.add_argument('-r', '--register', help='First holding register to read, default: 40000', type=int, default=40000)
+parser.add_argument('-n', '--count', help='Number of registers per request, default: 2', type=int, default=2)
+parser.add_argument('-d', '--depth', help='Requests in flight per connection, default: 4', type=int, default=4)
+parser.add_argument('-t', '--requests', help='Requests per connection, default: 200', type=int, default=200)
+parser.add_argument('--timeout', help='Socket timeout in seconds, default: 5', type=float, default=5)
+
+args = parser.parse_args()
+
+READ_HOLDING_REGISTERS = 3
+
+def request(transaction, unit, register, count):
+    # mbap header (transaction, protocol 0, length incl. unit id), unit id, pdu
+    return struct.pack('>HHHBBHH', transaction, 0, 6, unit, READ_HOLDING_REGISTERS, register, count)
+
+def recv_exact(sock, size):
+    data = b''
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            raise ConnectionError('connection closed by the meter')
+        data += chunk
+    return data
+
+def recv_frame(sock):
+    header = recv_exact(sock, 6)
+    transaction, protocol, length = struct.unpack('>HHH', header)
+    if protocol != 0:
+        raise ValueError(f'invalid protocol id {protocol}')
+    return transaction, recv_exact(sock, length)
+
+class Client:
+    def __init__(self, idx):
+        self.idx = idx
+        # distinct transaction id ranges per client to detect responses sent to the wrong connection
+        self.next_transaction = (idx << 12) & 0xffff
+        self.latencies = []
+        self.errors = []
+
+    def run(self):
+        try:
+            sock = socket.create_connection((args.host, args.port), timeout=args.timeout)
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        except OSError as e:
+            self.errors.append(f'connect failed: {e}')
+            return
+        in_flight = {}
+        sent = 0
+        try:
+            while sent < args.requests or in_flight:
+                while sent < args.requests and len(in_flight) < args.depth:
+                    transaction = self.next_transaction
+                    self.next_transaction = (self.next_transaction + 1) & 0xffff
+                    in_flight[transaction] = time.perf_counter()
+                    sock.sendall(request(transaction, args.unit, args.register, args.count))
+                    sent += 1
+                transaction, pdu = recv_frame(sock)
+                start = in_flight.pop(transaction, None)
+                if start is None:
+                    self.errors.append(f'unexpected transaction id {transaction}')
+                    continue
+                self.latencies.append(time.perf_counter() - start)
+                if pdu[1] & 0x80:
+                    self.errors.append(f'exception code {pdu[2]} for transaction {transaction}')
+        except (OSError, ValueError) as e:
+            self.errors.append(f'{e} with {len(in_flight)} requests in flight')
+        finally:
+            sock.close()
+
+def percentile(values, p):
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+clients = [Client(i) for i in range(args.clients)]
+threads = [threading.Thread(target=c.run) for c in clients]
+start = time.perf_counter()
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+duration = time.perf_counter() - start
+
+print(f'{"client":>6} {"ok":>6} {"err":>5} {"min ms":>8} {"avg ms":>8} {"p95 ms":>8} {"max ms":>8}')
+total = 0
+for c in clients:
+    lat = sorted(l * 1000 for l in c.latencies)
+    total += len(lat)
+    if lat:
+        print(f'{c.idx:>6} {len(lat):>6} {len(c.errors):>5} {lat[0]:>8.2f} {sum(lat) / len(lat):>8.2f} {percentile(lat, .95):>8.2f} {lat[-1]:>8.2f}')
+    else:
+        print(f'{c.idx:>6} {0:>6} {len(c.errors):>5}')
+    for e in c.errors[:5]:
+        print(f'       {e}')
+print(f'{total} responses in {duration:.2f} s, {total / duration:.1f} requests/s')
@@ -51,6 +51,7 @@ struct crypto_storage {
 	bool set_password(std::string_view password) {
 		user_pwd.fill(password);
 		persistent_storage_t::Default().write(user_pwd, &persistent_storage_layout::user_pwd);
+		persistent_storage_t::Default().request_commit();
 		return false;
 	}
 
@@ -4,13 +4,24 @@
 #include <modbus-actor.h>
 
 #include "hardware/uart.h"
+#include "hardware/irq.h"
+#include "pico/time.h"
+
+#include "FreeRTOS.h"
+#include "task.h"
 
 #include <log_storage.h>
 
 namespace ls = libmodbus_static;
 
+/**
+ * @brief Modbus rtu transport over the uart with an rs485 transceiver.
+ * Receiving is done in the uart rx irq into a ring buffer, the end of a frame is detected
+ * by the modbus 3.5 character silence via an alarm, which then wakes the task waiting in read_bytes()
+ */
 struct rtu_io {
 	static constexpr ls::transport_t TRANSPORT_TYPE{ls::transport_t::RTU};
+	static constexpr int BITS_PER_CHAR{11}; // modbus spec: start + 8 data + parity/stop + stop
 
 	const int rx_pin{0};
 	const int tx_pin{1};
@@ -19,6 +30,14 @@ struct rtu_io {
 	uart_inst_t *const uart{uart0};
 	static_vector<uint8_t, 1024> receive_buffer{};
 
+	// shared with the irq handlers, only accessed inside critical sections
+	static_ring_buffer<uint8_t, 512> _rx_ring{};
+	uint64_t _last_rx_us{};
+	bool _gap_alarm_armed{};
+	bool _frame_done{};
+	TaskHandle_t _data_retrieve_wait{};
+	static inline rtu_io *_instance{}; // uart irq handlers do not get user data
+
 	void init() {
 		uint32_t baud = uart_init(uart, baudrate);
 		gpio_set_function(tx_pin, GPIO_FUNC_UART);
@@ -26,25 +45,105 @@ struct rtu_io {
 		gpio_init(send_enable_pin);
 		gpio_set_dir(send_enable_pin, GPIO_OUT);
 		gpio_put(send_enable_pin, 0); // by default enable receive
+
+		// without fifo every character raises the irq, which keeps the frame gap timing exact
+		_instance = this;
+		uart_set_fifo_enabled(uart, false);
+		int irq = uart == uart0 ? UART0_IRQ: UART1_IRQ;
+		irq_set_exclusive_handler(irq, _uart_rx_irq);
+		irq_set_enabled(irq, true);
+		uart_set_irq_enables(uart, true, false);
 		LogInfo("Rtu io enabled on rx {}, tx {}, send_enable {}, baudrate {}(should be)", rx_pin, tx_pin, send_enable_pin, baud, baudrate);
 	}
 	void deinit() {
+		uart_set_irq_enables(uart, false, false);
+		irq_set_enabled(uart == uart0 ? UART0_IRQ: UART1_IRQ, false);
+		_instance = nullptr;
 	}
+	/** @brief silent interval after which a frame is complete, fixed to 1750us above 19200 baud (modbus spec) */
+	constexpr uint32_t frame_gap_us() const {
+		if (baudrate > 19200)
+			return 1750;
+		return 35 * BITS_PER_CHAR * 100'000 / baudrate;
+	}
+	/** @brief waits until a full frame was received (frame gap detected) or max_timeout passed
+	  * and returns all bytes received since the last call */
 	std::span<uint8_t> read_bytes(std::chrono::milliseconds max_timeout) {
+		taskENTER_CRITICAL();
+		bool frame_done = _frame_done;
+		xTaskNotifyStateClear(nullptr); // drop notifications from frames that came after a previous timeout
+		ulTaskNotifyValueClear(nullptr, UINT32_MAX);
+		_data_retrieve_wait = frame_done ? nullptr: xTaskGetCurrentTaskHandle();
+		taskEXIT_CRITICAL();
+
+		if (!frame_done)
+			ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(max_timeout.count()));
+
 		receive_buffer.clear();
-		while (uart_is_readable(uart))
-			receive_buffer.push(uart_getc(uart)) ;
+		taskENTER_CRITICAL();
+		for (uint8_t b: _rx_ring)
+			receive_buffer.push(b);
+		_rx_ring.clear();
+		_frame_done = false;
+		_data_retrieve_wait = {};
+		taskEXIT_CRITICAL();
 		return receive_buffer.span();
 	}
 	void write_bytes(std::span<uint8_t> data) {
+		// anything still in the ring buffer belongs to an old frame
+		taskENTER_CRITICAL();
+		_rx_ring.clear();
+		_frame_done = false;
+		taskEXIT_CRITICAL();
+
 		gpio_put(send_enable_pin, 1);
 		for (uint8_t d: data)
 			uart_putc_raw(uart, d);
+		uart_tx_wait_blocking(uart); // keep the transceiver in send mode until the last bit left
 		gpio_put(send_enable_pin, 0);
 	}
 	ls::result get_status() const {
 		return ls::OK;
 	}
+
+	/*INTERNAL*/ static void _uart_rx_irq() {
+		rtu_io *io = _instance;
+		if (!io)
+			return;
+		UBaseType_t s = taskENTER_CRITICAL_FROM_ISR();
+		while (uart_is_readable(io->uart))
+			io->_rx_ring.push(uart_getc(io->uart));
+		io->_last_rx_us = time_us_64();
+		bool arm = !io->_gap_alarm_armed;
+		io->_gap_alarm_armed = true;
+		taskEXIT_CRITICAL_FROM_ISR(s);
+		if (arm && add_alarm_in_us(io->frame_gap_us(), _frame_gap_alarm, io, true) <= 0) {
+			s = taskENTER_CRITICAL_FROM_ISR();
+			io->_gap_alarm_armed = false;
+			taskEXIT_CRITICAL_FROM_ISR(s);
+		}
+	}
+	/*INTERNAL*/ static int64_t _frame_gap_alarm(alarm_id_t, void *user_data) {
+		rtu_io &io = *reinterpret_cast<rtu_io*>(user_data);
+		TaskHandle_t waiting{};
+		UBaseType_t s = taskENTER_CRITICAL_FROM_ISR();
+		int64_t remaining_us = int64_t(io.frame_gap_us()) - int64_t(time_us_64() - io._last_rx_us);
+		if (remaining_us <= 0) {
+			io._gap_alarm_armed = false;
+			io._frame_done = true;
+			waiting = io._data_retrieve_wait;
+			io._data_retrieve_wait = {};
+		}
+		taskEXIT_CRITICAL_FROM_ISR(s);
+		if (remaining_us > 0)
+			return -remaining_us; // more bytes came in, re-check once the line was silent long enough
+		if (waiting) {
+			BaseType_t woken{pdFALSE};
+			vTaskNotifyGiveFromISR(waiting, &woken);
+			portYIELD_FROM_ISR(woken);
+		}
+		return 0;
+	}
 };
 
 namespace g {
@@ -53,4 +152,3 @@ inline ls::modbus_actor<eastron_layout, rtu_io>& eastron_modbus() {
 	return eastron;
 }
 }
-
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <concepts>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+
+/**
+ * @brief Small formatter for the replacement fields actually used in this project, replaces std::format
+ * which pulls in a lot of generic formatting code.
+ * Supported are "{}" for integers, bool, char, strings and floats, "{:x}" for integers as hex,
+ * "{:.Nf}" (N = 0..6) for fixed point floats and "{{"/"}}" as escaped braces.
+ * Floats with "{}" are written with up to 6 decimals without trailing zeros (without decimals beyond +-9.2e12),
+ * values beyond +-9.2e18 as +-inf.
+ * The format string is checked at compile time (amount of fields and specs) like std::format_string.
+ */
+namespace fast_format {
+
+constexpr int MAX_DECIMALS{6};
+constexpr std::array<int64_t, MAX_DECIMALS + 1> POW10{1, 10, 100, 1'000, 10'000, 100'000, 1'000'000};
+constexpr double MAX_SCALED{9.2e18}; // limit of value * 10^decimals, rounded it still fits into int64
+static_assert(MAX_SCALED < 9223372036854775807.0);
+
+/** @return amount of decimal digits of u */
+constexpr int uint_size(uint64_t u) {
+	int digits = 1;
+	// 32 bit divisions are considerably cheaper on the cortex-m0+
+	for (; u > UINT32_MAX; u /= 10)
+		++digits;
+	for (uint32_t v = u; v >= 10; v /= 10)
+		++digits;
+	return digits;
+}
+/** @brief writes exactly digits decimal digits of u (zero padded), the caller ensures enough room */
+constexpr char* write_uint(char *out, uint64_t u, int digits) {
+	char *p = out + digits;
+	for (; u > UINT32_MAX && p > out; u /= 10)
+		*--p = '0' + u % 10;
+	for (uint32_t v = u; p > out; v /= 10)
+		*--p = '0' + v % 10;
+	return out + digits;
+}
+
+/** @brief rounds v * 10^decimals to the nearest integer (ties to even, like std::format, as the product of
+  * a float and a power of 10 up to 10^6 is exact in double)
+  * @return false if v is not finite or v * 10^decimals does not fit into int64 */
+inline bool to_fixed(double v, int decimals, int64_t &scaled) {
+	if (!(std::fabs(v) * POW10[decimals] < MAX_SCALED))
+		return false;
+	scaled = std::llrint(v * POW10[decimals]);
+	return true;
+}
+/** @return size of the fixed point number scaled / 10^decimals */
+constexpr int fixed_size(int64_t scaled, int decimals, bool negative = false) {
+	uint64_t u = scaled < 0 ? -scaled: scaled;
+	int integer_digits = uint_size(u / POW10[decimals]);
+	return (scaled < 0 || negative) + integer_digits + (decimals ? decimals + 1: 0);
+}
+/** @brief writes scaled / 10^decimals with exactly decimals digits after the point, the caller ensures enough room
+  * @param negative writes the sign also for a scaled value of 0 (negative values rounding to zero, "-0.00") */
+constexpr char* write_fixed(char *out, int64_t scaled, int decimals, bool negative = false) {
+	if (scaled < 0 || negative)
+		*out++ = '-';
+	uint64_t u = scaled < 0 ? -scaled: scaled;
+	uint64_t integer = u / POW10[decimals];
+	out = write_uint(out, integer, uint_size(integer));
+	if (decimals) {
+		*out++ = '.';
+		out = write_uint(out, u - integer * POW10[decimals], decimals);
+	}
+	return out;
+}
+
+// ------------------------------------------------------------------------------
+// single values, each writes at max cap bytes and returns the written size
+// ------------------------------------------------------------------------------
+constexpr int write_str(char *out, int cap, std::string_view s) {
+	int size = std::min<int>(s.size(), cap);
+	std::copy_n(s.data(), size, out);
+	return size;
+}
+template<std::integral T>
+constexpr int write_int(char *out, int cap, T v, bool hex = false) {
+	char tmp[24];
+	char *p = tmp + sizeof(tmp);
+	bool negative = v < 0;
+	uint64_t u = negative ? uint64_t(0) - uint64_t(v): uint64_t(v);
+	if (hex) {
+		do { *--p = "0123456789abcdef"[u & 0xf]; u >>= 4; } while (u);
+	} else {
+		for (; u > UINT32_MAX; u /= 10)
+			*--p = '0' + u % 10;
+		uint32_t v = u;
+		do { *--p = '0' + v % 10; v /= 10; } while (v);
+	}
+	if (negative)
+		*--p = '-';
+	return write_str(out, cap, {p, size_t(tmp + sizeof(tmp) - p)});
+}
+/** @param decimals -1 for shortest up to MAX_DECIMALS decimals ("{}") */
+inline int write_float(char *out, int cap, double v, int decimals) {
+	if (std::isnan(v))
+		return write_str(out, cap, "nan");
+	int d = decimals < 0 ? MAX_DECIMALS: decimals;
+	int64_t scaled{};
+	if (!to_fixed(v, d, scaled) && !to_fixed(v, d = 0, scaled))
+		return write_str(out, cap, v < 0 ? "-inf": "inf");
+	if (decimals < 0) {
+		for (; d > 0 && scaled % 10 == 0; --d)
+			scaled /= 10;
+	}
+	char tmp[32];
+	char *end = write_fixed(tmp, scaled, d, std::signbit(v));
+	return write_str(out, cap, {tmp, size_t(end - tmp)});
+}
+
+/** @brief replacement field spec, already validated by the format string */
+struct spec {
+	bool hex{};
+	int decimals{-1};
+};
+consteval bool parse_spec(std::string_view s, spec &r) {
+	r = {};
+	if (s.empty())
+		return true;
+	if (s == ":x") {
+		r.hex = true;
+		return true;
+	}
+	if (s.size() == 4 && s.starts_with(":.") && s[3] == 'f' && s[2] >= '0' && s[2] <= '0' + MAX_DECIMALS) {
+		r.decimals = s[2] - '0';
+		return true;
+	}
+	return false;
+}
+constexpr spec runtime_spec(std::string_view s) {
+	if (s == ":x")
+		return {.hex = true};
+	if (s.size() == 4)
+		return {.decimals = s[2] - '0'};
+	return {};
+}
+
+template<typename T>
+constexpr int write_arg(char *out, int cap, const T &v, spec s) {
+	using D = std::remove_cvref_t<T>;
+	if constexpr (std::is_same_v<D, bool>)
+		return write_str(out, cap, v ? "true": "false");
+	else if constexpr (std::is_same_v<D, char>)
+		return write_str(out, cap, {&v, 1});
+	else if constexpr (std::integral<D>)
+		return write_int(out, cap, v, s.hex);
+	else if constexpr (std::floating_point<D>)
+		return write_float(out, cap, v, s.decimals);
+	else if constexpr (std::is_enum_v<D>)
+		return write_int(out, cap, std::underlying_type_t<D>(v), s.hex);
+	else
+		return write_str(out, cap, std::string_view{v});
+}
+
+template<typename T>
+consteval bool spec_fits() {
+	using D = std::remove_cvref_t<T>;
+	return std::integral<D> || std::floating_point<D> || std::is_enum_v<D> || std::is_convertible_v<const D&, std::string_view>;
+}
+
+/** @brief format string checked at compile time against the argument types, see the file comment */
+template<typename... Args>
+struct basic_format_string {
+	std::string_view str;
+
+	template<typename S> requires std::is_convertible_v<const S&, std::string_view>
+	consteval basic_format_string(const S &s): str{s} {
+		static_assert((spec_fits<Args>() && ...), "Unsupported format argument type");
+		int fields{};
+		for (size_t i = 0; i < str.size(); ++i) {
+			if (str[i] == '{' && i + 1 < str.size() && str[i + 1] == '{') {
+				++i;
+			} else if (str[i] == '{') {
+				size_t end = str.find('}', i);
+				spec r{};
+				if (end == std::string_view::npos || !parse_spec(str.substr(i + 1, end - i - 1), r))
+					throw "Invalid replacement field";
+				++fields;
+				i = end;
+			} else if (str[i] == '}') {
+				if (i + 1 >= str.size() || str[i + 1] != '}')
+					throw "Unmatched } in format string, use }}";
+				++i;
+			}
+		}
+		if (fields != sizeof...(Args))
+			throw "Amount of replacement fields does not match the amount of arguments";
+	}
+};
+template<typename... Args>
+using format_string = basic_format_string<std::type_identity_t<Args>...>;
+
+/** @brief copies the format string f into out and calls write_field(n, out, cap, spec) for the n-th replacement field,
+  * which returns the amount of bytes it wrote. f has to be validated already (see basic_format_string)
+  * @return amount of written bytes */
+template<typename F>
+constexpr int format_fields(char *out, int cap, std::string_view f, F &&write_field) {
+	int written{};
+	int arg{};
+	for (size_t i = 0; i < f.size() && written < cap; ++i) {
+		char c = f[i];
+		if ((c == '{' || c == '}') && i + 1 < f.size() && f[i + 1] == c) { // escaped brace
+			out[written++] = c;
+			++i;
+			continue;
+		}
+		if (c != '{') {
+			out[written++] = c;
+			continue;
+		}
+		size_t end = f.find('}', i);
+		written += write_field(arg++, out + written, cap - written, runtime_spec(f.substr(i + 1, end - i - 1)));
+		i = end;
+	}
+	return written;
+}
+
+/** @brief formats into out, at max cap bytes
+  * @return amount of written bytes */
+template<typename... Args>
+constexpr int format_to(char *out, int cap, format_string<Args...> fmt, const Args&... args) {
+	return format_fields(out, cap, fmt.str, [&](int n, char *field_out, int field_cap, spec s) {
+		int i{}, written{};
+		((i++ == n ? void(written = write_arg(field_out, field_cap, args, s)): void()), ...);
+		return written;
+	});
+}
+
+} // namespace fast_format
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <span>
+#include <string_view>
+
+#include "pico/flash.h"
+#include "hardware/flash.h"
+
+#include "log_storage.h"
+#include "mutex.h"
+#include "persistent_storage.h"
+
+enum struct flash_record_type: uint8_t {
+	boot = 1, // no payload, written once after each start
+	log = 2, // uint8_t severity followed by the message
+	energy = 3, // float imported Wh, float exported Wh
+	erased = 0xff, // never written, marks the end of the data in a page
+};
+
+/** @brief header in front of each record payload, stored unaligned (6 bytes) */
+struct flash_record_header {
+	flash_record_type type;
+	uint8_t size; // payload size
+	uint32_t time; // unix time in seconds, seconds since the last boot record while the clock is not set (below 1e9)
+};
+
+/**
+ * @brief Append only log of small records in a ring of flash sectors, the oldest sector is erased when the ring is full.
+ * Records are collected in a ram copy of the newest sector and programmed in whole pages when the sector
+ * is full or on flush(), so that a sector is erased only once per 4 KB of records and all sectors
+ * are erased equally often. flush() pads the last page, the next record starts on the following page.
+ * On init() only the sector headers and the newest sector are read to restore the write position.
+ *
+ * Sector layout:
+ * uint32_t magic ("FLOG"), uint32_t seq (incremented for each started sector, the newest sector has the highest seq)
+ * records: flash_record_header followed by size bytes payload, a record type 0xff skips to the next page (padding),
+ * at a page start it marks the end of the sector data.
+ * @note All writing functions have to be called from the same task, they block while flash is programmed or erased.
+ * @usage
+ * flash_log_t::Default().init(log_storage::Default());
+ * flash_log_t::Default().append(flash_record_type::energy, time, values);
+ * flash_log_t::Default().flush();
+ */
+template<uint32_t begin_offset, int SECTORS>
+struct flash_log {
+	static constexpr uint32_t MAGIC{0x474f4c46};
+	static constexpr int SECTOR_HEADER_SIZE{8};
+	static constexpr int RECORD_HEADER_SIZE{6};
+	static_assert(begin_offset % FLASH_SECTOR_SIZE == 0);
+
+	static flash_log& Default() {
+		static flash_log l{};
+		return l;
+	}
+
+	std::array<uint32_t, SECTORS> sector_seqs{}; // index of the sectors, 0 for unused or erased sectors
+	int head{-1}; // sector which is currently written
+	uint32_t head_seq{};
+	std::array<uint8_t, FLASH_SECTOR_SIZE> buffer{}; // ram copy of the head sector
+	int write_pos{};
+	int programmed{}; // bytes of the buffer which are already in flash
+	log_storage::cursor persisted_logs{}; // position up to which the logs are in the flash log
+	mutex _index_mutex{};
+
+	/** @brief restores the write position and the newest log messages into log */
+	void init(log_storage &log) {
+		for (int i = 0; i < SECTORS; ++i) {
+			uint32_t header[2];
+			memcpy(header, _sector_begin(i), sizeof(header));
+			sector_seqs[i] = header[0] == MAGIC ? header[1]: 0;
+			if (sector_seqs[i] && sector_seqs[i] >= head_seq) {
+				head = i;
+				head_seq = sector_seqs[i];
+			}
+		}
+		if (head >= 0) {
+			memcpy(buffer.data(), _sector_begin(head), buffer.size());
+			int end = _for_each_record(buffer, [](const flash_record_header&, std::span<const uint8_t>){});
+			write_pos = programmed = std::min<int>((end + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE, buffer.size());
+			// the previous and the head sector hold the newest logs
+			int prev = (head + SECTORS - 1) % SECTORS;
+			const auto restore = [&log](const flash_record_header &h, std::span<const uint8_t> payload) {
+				if (h.type == flash_record_type::log && payload.size())
+					log.push(log_severity(payload[0]), {reinterpret_cast<const char*>(payload.data() + 1), payload.size() - 1});
+			};
+			if (sector_seqs[prev] && sector_seqs[prev] < head_seq)
+				_for_each_record({reinterpret_cast<const uint8_t*>(_sector_begin(prev)), FLASH_SECTOR_SIZE}, restore);
+			_for_each_record(buffer, restore);
+		}
+		persisted_logs = log.end();
+		LogInfo("Flash log at sector {} seq {} offset {}", head, head_seq, write_pos);
+	}
+
+	/** @brief adds a record to the ram copy of the head sector, a full sector is programmed and the next one erased first
+	  * @return false if the payload is too large */
+	bool append(flash_record_type type, uint32_t time, std::span<const uint8_t> payload) {
+		if (payload.size() > UINT8_MAX || type == flash_record_type::erased)
+			return false;
+		int size = RECORD_HEADER_SIZE + payload.size();
+		if (head < 0 || write_pos + size > int(buffer.size()))
+			_next_sector();
+		flash_record_header h{.type = type, .size = uint8_t(payload.size()), .time = time};
+		buffer[write_pos] = uint8_t(h.type);
+		buffer[write_pos + 1] = h.size;
+		memcpy(buffer.data() + write_pos + 2, &h.time, sizeof(h.time));
+		memcpy(buffer.data() + write_pos + RECORD_HEADER_SIZE, payload.data(), payload.size());
+		write_pos += size;
+		return true;
+	}
+	/** @brief appends the log messages pushed since the previous call with at least min_severity, formatted */
+	void persist_logs(const log_storage &log, uint32_t time, log_severity min_severity = log_severity::Warning) {
+		log_storage::cursor end = log.end();
+		log.for_each(persisted_logs, end, min_severity, [&](log_severity severity, std::string_view message) {
+			std::array<uint8_t, MAX_LOG_LENGTH + 1> payload;
+			payload[0] = uint8_t(severity);
+			memcpy(payload.data() + 1, message.data(), message.size());
+			append(flash_record_type::log, time, {payload.data(), message.size() + 1});
+		});
+		persisted_logs = end;
+	}
+	/** @brief programs the not yet programmed records, the rest of the last page stays unused */
+	void flush() {
+		if (head < 0 || write_pos == programmed)
+			return;
+		int end = (write_pos + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+		_write_data data{.offset = _sector_offset(head) + programmed, .src = buffer.data() + programmed, .size = uint32_t(end - programmed)};
+		int r = flash_safe_execute(_flash_program, &data, UINT32_MAX);
+		if (r != PICO_OK)
+			LogError("Failed to program flash log: {}", r);
+		write_pos = programmed = std::min(end, int(buffer.size()));
+	}
+	/** @brief copies programmed content of the oldest sector with a sequence number of at least seq, starting at offset.
+	  * The copy is taken with the index lock held, which _next_sector() needs before it erases a sector, so it never
+	  * mixes old and erased content (the flash can not be sent by reference as it might be erased before it was acknowledged)
+	  * @param seq set to the sequence number of the copied sector, for offset > 0 only a sector with exactly seq is copied
+	  * @param size set to the programmed size of the copied sector
+	  * @return amount of copied bytes, -1 if there is no such sector */
+	int read_sector(uint32_t &seq, uint32_t offset, std::span<char> dst, uint32_t &size) {
+		scoped_lock lock{_index_mutex};
+		int found{-1};
+		for (int i = 0; i < SECTORS; ++i)
+			if ((offset ? sector_seqs[i] == seq: sector_seqs[i] >= seq) && sector_seqs[i] && (found < 0 || sector_seqs[i] < sector_seqs[found]))
+				found = i;
+		if (found < 0)
+			return -1;
+		seq = sector_seqs[found];
+		size = found == head ? uint32_t(programmed): uint32_t(FLASH_SECTOR_SIZE);
+		int copied = std::min<int>(dst.size(), std::max<int>(int(size) - int(offset), 0));
+		memcpy(dst.data(), _sector_begin(found) + offset, copied);
+		return copied;
+	}
+
+	/*INTERNAL*/ static const char* _sector_begin(int i) { return flash_begin + _sector_offset(i); }
+	/*INTERNAL*/ static uint32_t _sector_offset(int i) { return begin_offset + i * FLASH_SECTOR_SIZE; }
+	/** @brief calls f(header, payload) for each record of the sector
+	  * @return end of the sector data */
+	/*INTERNAL*/ template<typename F>
+	static int _for_each_record(std::span<const uint8_t> sector, F &&f) {
+		int pos = SECTOR_HEADER_SIZE;
+		while (pos + RECORD_HEADER_SIZE <= int(sector.size())) {
+			if (sector[pos] == uint8_t(flash_record_type::erased)) {
+				if (pos % FLASH_PAGE_SIZE == 0)
+					break;
+				pos = (pos / FLASH_PAGE_SIZE + 1) * FLASH_PAGE_SIZE;
+				continue;
+			}
+			flash_record_header h{.type = flash_record_type(sector[pos]), .size = sector[pos + 1]};
+			memcpy(&h.time, sector.data() + pos + 2, sizeof(h.time));
+			if (pos + RECORD_HEADER_SIZE + h.size > int(sector.size()))
+				break;
+			f(h, sector.subspan(pos + RECORD_HEADER_SIZE, h.size));
+			pos += RECORD_HEADER_SIZE + h.size;
+		}
+		return std::min(pos, int(sector.size()));
+	}
+	/*INTERNAL*/ void _next_sector() {
+		flush();
+		head = (head + 1) % SECTORS;
+		{
+			scoped_lock lock{_index_mutex};
+			sector_seqs[head] = 0;
+		}
+		_write_data data{.offset = _sector_offset(head), .src = nullptr, .size = FLASH_SECTOR_SIZE};
+		int r = flash_safe_execute(_flash_erase, &data, UINT32_MAX);
+		if (r != PICO_OK)
+			LogError("Failed to erase flash log sector: {}", r);
+		buffer.fill(0xff);
+		uint32_t header[2]{MAGIC, ++head_seq};
+		memcpy(buffer.data(), header, sizeof(header));
+		write_pos = SECTOR_HEADER_SIZE;
+		programmed = 0;
+		scoped_lock lock{_index_mutex};
+		sector_seqs[head] = head_seq;
+	}
+	/*INTERNAL*/ struct _write_data { uint32_t offset; const uint8_t *src; uint32_t size; };
+	/*INTERNAL*/ static void __no_inline_not_in_flash_func(_flash_erase)(void *d) {
+		const _write_data &data = *reinterpret_cast<const _write_data*>(d);
+		flash_range_erase(data.offset, data.size);
+	}
+	/*INTERNAL*/ static void __no_inline_not_in_flash_func(_flash_program)(void *d) {
+		const _write_data &data = *reinterpret_cast<const _write_data*>(d);
+		flash_range_program(data.offset, data.src, data.size);
+	}
+};
+
+constexpr int FLASH_LOG_SECTORS{64};
+constexpr uint32_t FLASH_LOG_END{persistent_storage_t::begin_offset};
+/** @brief directly in front of the persistent_storage_t sectors, the firmware has to end before */
+using flash_log_t = flash_log<FLASH_LOG_END - FLASH_LOG_SECTORS * FLASH_SECTOR_SIZE, FLASH_LOG_SECTORS>;
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+#include "static_types.h"
+#include "fast_format.h"
+#include "register_mapping.h"
+
+/** @brief json key of a float destination register, see json_writer */
+template<typename T>
+struct json_field {
+	std::string_view key;
+	float T::* member;
+};
+
+/**
+ * @brief Serializes the values of a mapped_registers as flat json object with 2 decimals per value.
+ * The field table is resolved to mapping indices and the constant part of the output (keys, quotes,
+ * separators) is sized at compile time. The values are converted once to fixed point in the constructor,
+ * so that size() is exact and cheap and the Content-Length can be written before the body.
+ * Non finite values are written as null to keep the json valid.
+ * @usage
+ * inline constexpr std::array fields{json_field{"power", &halfs_sunspec::w}};
+ * json_writer<fields, eastron_sunspec_mapping> json{values};
+ * res.res_add_header("Content-Length", static_format<8>("{}", json.size()));
+ * res.res_write_body();
+ * json.append_to(res.buffer);
+ */
+template<const auto &fields, const auto &mapping>
+struct json_writer {
+	static constexpr int SIZE = fields.size();
+	static constexpr int64_t INVALID = INT64_MIN;
+	static constexpr int DECIMALS = 2;
+
+	static consteval std::array<int, SIZE> build_indices() {
+		std::array<int, SIZE> indices{};
+		for (int i = 0; i < SIZE; ++i)
+			indices[i] = mapped_registers<mapping>::index_of(fields[i].member);
+		return indices;
+	}
+	static constexpr std::array<int, SIZE> indices = build_indices();
+	static consteval int keys_size() {
+		int size = 2 + (SIZE - 1); // braces and commas
+		for (const auto &field: fields)
+			size += field.key.size() + 3; // quotes and colon
+		return size;
+	}
+	static constexpr int KEYS_SIZE = keys_size();
+
+	std::array<int64_t, SIZE> cents{}; // values times 100, rounded the same as {:.2f} (but negative values rounding to zero are written as 0.00)
+
+	explicit json_writer(const mapped_registers<mapping> &values) {
+		for (int i = 0; i < SIZE; ++i)
+			if (!fast_format::to_fixed(values.values[indices[i]], DECIMALS, cents[i]))
+				cents[i] = INVALID;
+	}
+
+	/** @return exact size of the json object in bytes */
+	int size() const {
+		int size = KEYS_SIZE;
+		for (int64_t c: cents)
+			size += value_size(c);
+		return size;
+	}
+	/** @brief appends the json object, nothing is appended if it does not fit
+	  * @return amount of written bytes */
+	template<int N>
+	int append_to(static_string<N> &s) const {
+		int total = size();
+		if (s.size() + total > int(s.storage.size()))
+			return 0;
+		char *out = s.data() + s.size();
+		*out++ = '{';
+		for (int i = 0; i < SIZE; ++i) {
+			if (i)
+				*out++ = ',';
+			*out++ = '"';
+			out = std::copy(fields[i].key.begin(), fields[i].key.end(), out);
+			*out++ = '"';
+			*out++ = ':';
+			out = write_value(out, cents[i]);
+		}
+		*out++ = '}';
+		s.set_size(s.size() + total);
+		return total;
+	}
+
+	static int value_size(int64_t c) {
+		return c == INVALID ? 4: fast_format::fixed_size(c, DECIMALS);
+	}
+	static char* write_value(char *out, int64_t c) {
+		return c == INVALID ? std::copy_n("null", 4, out): fast_format::write_fixed(out, c, DECIMALS);
+	}
+};
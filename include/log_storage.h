@@ -1,67 +1,323 @@
 #pragma once
 
-#include <print>
+#include <atomic>
 #include <iostream>
+#include <cstring>
+
+#include "pico/platform.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+
 #include "static_types.h"
 
-constexpr int MAX_LOGS{128};
-constexpr int MAX_LOG_LENGTH{64};
+constexpr int LOG_CORES{2};
+constexpr int LOG_BUFFER_SIZE{8192}; // split evenly into one ring per core
+constexpr int MAX_LOG_LENGTH{64}; // formatted messages are cut to this length
+constexpr int MAX_LOG_ARGS_SIZE{64}; // packed arguments of a record, strings are cut to fit
 
-enum struct log_severity {
+enum struct log_severity: uint8_t {
 	Info,
 	Warning,
 	Error,
 	Fatal,
 };
 
+/** @brief type tag in front of each packed log argument */
+enum struct log_arg: uint8_t {
+	i32,
+	u32,
+	i64,
+	u64,
+	f32,
+	f64,
+	boolean,
+	character,
+	string, // uint8_t length followed by the characters
+};
+
 /**
  * @brief Error storage that is a circular buffer to hold all errors from the past
- * and overwrites old errors upon too many errors
+ * and overwrites old errors upon too many errors.
+ * Formatted logs only store the pointer to the format string and the packed arguments (type tag and raw bytes,
+ * strings are copied), the message is formatted only when the logs are read. This keeps formatting off the
+ * hot paths and a record mostly takes 16 to 30 bytes instead of a fixed 64 byte message.
+ * Each core has its own byte ring, in which the records are stored without gaps, a record that does not fit at
+ * the end starts at the beginning again (the rest is marked with WRAP), the oldest records are dropped to make room.
+ * A ring is only written by its core with the interrupts of this core disabled for the push, so logging
+ * works from tasks, lwip callbacks and interrupts (eg. alarms) without ever waiting for the other core.
+ * Readers copy a record out of a ring and retry if the ring changed meanwhile (seq, like a seqlock), the rings
+ * are merged by the record time, records pushed at the same time on both cores might appear in either order.
  */
 struct log_storage {
 	static log_storage& Default();
-	struct log_entry{
-		log_severity severity{log_severity::Info};
-		static_string<MAX_LOG_LENGTH> message{};
+	/** @brief stored in front of the packed arguments */
+	struct record_header {
+		log_severity severity;
+		uint8_t args_size;
+		uint16_t fmt_size;
+		uint32_t time; // time_us_64() / 1024, orders the records of the rings
+		const char *fmt; // nullptr for a plain message, which is then stored instead of the arguments
+	};
+	static constexpr int HEADER_SIZE = sizeof(record_header);
+	static constexpr uint8_t WRAP{0xff}; // severity byte at which the rest of the buffer is skipped
+	static constexpr std::array<std::string_view, 4> severity_prefixes{"[Info   ]: ", "[Warning]: ", "[Error  ]: ", "[Fatal  ]: "};
+
+	/** @brief record copied out of a ring by ring::next() */
+	struct record {
+		record_header h{};
+		std::array<uint8_t, MAX_LOG_ARGS_SIZE> args;
+	};
+	/** @brief records of one core, only pushed by this core with its interrupts disabled */
+	struct ring {
+		static constexpr int SIZE = LOG_BUFFER_SIZE / LOG_CORES;
+		std::array<uint8_t, SIZE> buffer{};
+		int first{}; // position of the oldest record
+		int write{}; // position of the next record
+		uint32_t first_index{}; // index of the oldest record
+		uint32_t pushed{}; // amount of pushed records since start, index of the next record
+		std::atomic<uint32_t> seq{}; // odd while a record is pushed
+
+		void push(const record_header &h, const uint8_t *args) {
+			int size = HEADER_SIZE + h.args_size;
+			seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			if (write + size > SIZE) { // continue at the start, the records behind write are dropped
+				while (pushed != first_index && first >= write)
+					_drop_first();
+				if (write < SIZE)
+					buffer[write] = WRAP;
+				write = 0;
+			}
+			while (pushed != first_index && first >= write && first < write + size)
+				_drop_first();
+			if (pushed == first_index)
+				first = write;
+			memcpy(buffer.data() + write, &h, HEADER_SIZE);
+			memcpy(buffer.data() + write + HEADER_SIZE, args, h.args_size);
+			write += size;
+			++pushed;
+			seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+		/** @brief copies the next stored record with index in [from, to) after index into r, pos is the position of index,
+		  * a negative pos starts at the oldest record
+		  * @return false if there is no more record */
+		bool next(uint32_t &index, int &pos, uint32_t from, uint32_t to, record &r) const {
+			for (;;) {
+				uint32_t s = seq.load(std::memory_order_acquire);
+				if (s & 1) // the other core is pushing right now
+					continue;
+				uint32_t i = index;
+				int p = pos;
+				if (p < 0 || int32_t(i - first_index) < 0) { // not started yet or overwritten meanwhile
+					i = first_index;
+					p = first;
+				}
+				bool found = i != pushed && int32_t(i - to) < 0;
+				if (found) {
+					if (p >= SIZE || buffer[p] == WRAP)
+						p = 0;
+					memcpy(&r.h, buffer.data() + p, HEADER_SIZE);
+					r.h.args_size = std::min<int>({r.h.args_size, MAX_LOG_ARGS_SIZE, SIZE - p - HEADER_SIZE}); // only off for torn copies
+					memcpy(r.args.data(), buffer.data() + p + HEADER_SIZE, r.h.args_size);
+					p += HEADER_SIZE + r.h.args_size;
+				}
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (seq.load(std::memory_order_relaxed) != s)
+					continue;
+				index = i + found;
+				pos = p;
+				if (found && int32_t(i - from) < 0)
+					continue;
+				return found;
+			}
+		}
+		/*INTERNAL*/ void _drop_first() {
+			first += HEADER_SIZE + buffer[first + 1]; // args_size
+			++first_index;
+			if (first >= SIZE || buffer[first] == WRAP)
+				first = 0;
+		}
+	};
+	/** @brief position in the logs, index of the next record of each ring */
+	struct cursor {
+		std::array<uint32_t, LOG_CORES> index{};
 	};
 
-	static_ring_buffer<log_entry, MAX_LOGS> logs{};
+	std::array<ring, LOG_CORES> rings{};
 	log_severity cur_severity{log_severity::Info};
 	bool print_to_cout{false};
-	
-	constexpr log_entry* push(log_severity severity, std::string_view static_message = {}) noexcept {
+
+	cursor begin() const {
+		cursor c{};
+		for (int i = 0; i < LOG_CORES; ++i)
+			c.index[i] = rings[i].first_index;
+		return c;
+	}
+	cursor end() const {
+		cursor c{};
+		for (int i = 0; i < LOG_CORES; ++i)
+			c.index[i] = rings[i].pushed;
+		return c;
+	}
+
+	/** @brief stores the format string and the arguments, see the struct comment */
+	template<typename... Args>
+	void push_formatted(log_severity severity, fast_format::format_string<Args...> fmt, const Args&... args) noexcept {
+		if (severity < cur_severity)
+			return;
+		std::array<uint8_t, MAX_LOG_ARGS_SIZE> packed;
+		uint8_t *out = packed.data(), *end = packed.data() + packed.size();
+		bool full{}; // the following arguments are dropped as well to keep them aligned with the replacement fields
+		const auto pack = [&](const auto &arg) {
+			uint8_t *next = full ? nullptr: pack_arg(out, end, arg);
+			full = !next;
+			out = next ? next: out;
+		};
+		(pack(args), ...);
+		_push({.severity = severity, .args_size = uint8_t(out - packed.data()), .fmt_size = uint16_t(fmt.str.size()), .time = 0, .fmt = fmt.str.data()}, packed.data());
+	}
+	/** @brief stores a copy of the message */
+	void push(log_severity severity, std::string_view message) noexcept {
 		if (severity < cur_severity)
-			return {};
-		if (print_to_cout)
-			std::cout << static_message << std::endl;
-		log_entry *entry = logs.push();
-		if (!entry)
-			return {};
-		entry->severity = severity;
-		if (!static_message.empty())
-			entry->message.fill(static_message);
-		return entry;
+			return;
+		message = message.substr(0, MAX_LOG_LENGTH);
+		_push({.severity = severity, .args_size = uint8_t(message.size()), .fmt_size = 0, .time = 0, .fmt = nullptr}, reinterpret_cast<const uint8_t*>(message.data()));
 	}
+
+	/** @brief calls f(severity, message) for the stored records in [from, to) with at least min_severity in the order
+	  * they were pushed, the message is formatted into a temporary buffer */
+	template<typename F>
+	void for_each(const cursor &from, const cursor &to, log_severity min_severity, F &&f) const {
+		std::array<record, LOG_CORES> records;
+		std::array<uint32_t, LOG_CORES> index{};
+		std::array<int, LOG_CORES> pos{};
+		std::array<bool, LOG_CORES> valid{};
+		for (int i = 0; i < LOG_CORES; ++i) {
+			pos[i] = -1;
+			valid[i] = rings[i].next(index[i], pos[i], from.index[i], to.index[i], records[i]);
+		}
+		for (;;) {
+			int n{-1};
+			for (int i = 0; i < LOG_CORES; ++i)
+				if (valid[i] && (n < 0 || int32_t(records[i].h.time - records[n].h.time) < 0))
+					n = i;
+			if (n < 0)
+				return;
+			if (records[n].h.severity >= min_severity) {
+				char message[MAX_LOG_LENGTH];
+				f(records[n].h.severity, std::string_view{message, size_t(format_record(message, sizeof(message), records[n].h, records[n].args.data()))});
+			}
+			valid[n] = rings[n].next(index[n], pos[n], from.index[n], to.index[n], records[n]);
+		}
+	}
+	/** @brief calls f(severity, message) for all stored records */
+	template<typename F>
+	void for_each(F &&f) const { for_each(begin(), end(), log_severity::Info, f); }
+
+	/** @brief appends the newest records that fit into dst, oldest first. The first pass sums up the line sizes,
+	  * the second skips the oldest records that do not fit (records dropped in between only make it shorter)
+	  * @return amount of appended bytes */
 	template<int N>
 	int print_errors(static_string<N> &dst) const noexcept {
-		int s{};
-		for (const auto &[sev, message]: logs) {
-			switch(sev) {
-			case log_severity::Info:
-				s += dst.append_formatted("[Info   ]: {}\n", message.sv());
-				break;
-			case log_severity::Warning:
-				s += dst.append_formatted("[Warning]: {}\n", message.sv());
-				break;
-			case log_severity::Error:
-				s += dst.append_formatted("[Error  ]: {}\n", message.sv());
-				break;
-			case log_severity::Fatal:
-				s += dst.append_formatted("[Fatal  ]: {}\n", message.sv());
-				break;
+		const auto line_size = [](log_severity severity, std::string_view message) { return int(severity_prefixes[int(severity)].size() + message.size()) + 1; };
+		cursor to = end();
+		int total{};
+		for_each(begin(), to, log_severity::Info, [&](log_severity severity, std::string_view message) { total += line_size(severity, message); });
+		int skip = total - (int(dst.storage.size()) - dst.size());
+		int start = dst.size();
+		for_each(begin(), to, log_severity::Info, [&](log_severity severity, std::string_view message) {
+			if (skip > 0) {
+				skip -= line_size(severity, message);
+				return;
 			}
+			dst.append(severity_prefixes[int(severity)]);
+			dst.append(message);
+			dst.append('\n');
+		});
+		return dst.size() - start;
+	}
+
+	/** @brief packs the argument as type tag followed by its raw bytes, strings are cut to the remaining room
+	  * @return end of the packed argument, nullptr if it does not fit */
+	template<typename T>
+	static uint8_t* pack_arg(uint8_t *out, uint8_t *end, const T &v) {
+		using D = std::remove_cvref_t<T>;
+		if constexpr (std::is_same_v<D, bool>)
+			return pack_value(out, end, log_arg::boolean, v);
+		else if constexpr (std::is_same_v<D, char>)
+			return pack_value(out, end, log_arg::character, v);
+		else if constexpr (std::is_enum_v<D>)
+			return pack_arg(out, end, std::underlying_type_t<D>(v));
+		else if constexpr (std::integral<D> && sizeof(D) <= 4)
+			return std::is_signed_v<D> ? pack_value(out, end, log_arg::i32, int32_t(v)): pack_value(out, end, log_arg::u32, uint32_t(v));
+		else if constexpr (std::integral<D>)
+			return std::is_signed_v<D> ? pack_value(out, end, log_arg::i64, int64_t(v)): pack_value(out, end, log_arg::u64, uint64_t(v));
+		else if constexpr (std::is_same_v<D, float>)
+			return pack_value(out, end, log_arg::f32, v);
+		else if constexpr (std::floating_point<D>)
+			return pack_value(out, end, log_arg::f64, double(v));
+		else {
+			std::string_view s{v};
+			if (end - out < 2)
+				return nullptr;
+			int size = std::min<int>({int(s.size()), int(end - out) - 2, MAX_LOG_LENGTH});
+			*out++ = uint8_t(log_arg::string);
+			*out++ = uint8_t(size);
+			memcpy(out, s.data(), size);
+			return out + size;
 		}
-		return s;
+	}
+	template<typename T>
+	static uint8_t* pack_value(uint8_t *out, uint8_t *end, log_arg tag, T v) {
+		if (end - out < 1 + int(sizeof(T)))
+			return nullptr;
+		*out++ = uint8_t(tag);
+		memcpy(out, &v, sizeof(T));
+		return out + sizeof(T);
+	}
+	/** @brief formats the record with its packed arguments, missing arguments are left empty
+	  * @return amount of written bytes */
+	static int format_record(char *out, int cap, const record_header &h, const uint8_t *args) {
+		if (!h.fmt)
+			return fast_format::write_str(out, cap, {reinterpret_cast<const char*>(args), h.args_size});
+		const uint8_t *cur = args, *end = args + h.args_size;
+		return fast_format::format_fields(out, cap, {h.fmt, h.fmt_size}, [&](int, char *field_out, int field_cap, fast_format::spec s) {
+			if (cur >= end)
+				return 0;
+			const auto write = [&]<typename T>(T v) {
+				memcpy(&v, cur, sizeof(T));
+				cur += sizeof(T);
+				return fast_format::write_arg(field_out, field_cap, v, s);
+			};
+			switch (log_arg(*cur++)) {
+			case log_arg::i32: return write(int32_t{});
+			case log_arg::u32: return write(uint32_t{});
+			case log_arg::i64: return write(int64_t{});
+			case log_arg::u64: return write(uint64_t{});
+			case log_arg::f32: return write(float{});
+			case log_arg::f64: return write(double{});
+			case log_arg::boolean: return write(bool{});
+			case log_arg::character: return write(char{});
+			case log_arg::string: {
+				std::string_view str{reinterpret_cast<const char*>(cur + 1), *cur};
+				cur += 1 + str.size();
+				return fast_format::write_str(field_out, field_cap, str);
+			}
+			}
+			cur = end; // unknown tag, the rest is unusable
+			return 0;
+		});
+	}
+
+	/*INTERNAL*/ void _push(record_header h, const uint8_t *args) {
+		h.time = time_us_64() >> 10;
+		if (print_to_cout && !__get_current_exception()) {
+			char message[MAX_LOG_LENGTH];
+			std::cout << std::string_view{message, size_t(format_record(message, sizeof(message), h, args))} << std::endl;
+		}
+		uint32_t irq = save_and_disable_interrupts();
+		rings[get_core_num()].push(h, args);
+		restore_interrupts(irq);
 	}
 };
 
@@ -69,37 +325,13 @@ struct log_storage {
 // Formatted logging
 // ---------------------------------------------------------------------------------------
 template<typename... Args>
-inline void LogInfo(std::format_string<Args...> fmt, Args&&... args) { 
-	auto *entry = log_storage::Default().push(log_severity::Info); 
-	if (entry) {
-		entry->message.fill_formatted(fmt, std::forward<Args>(args)...);
-		//std::println("[Info   ]: {}", entry->message.view);
-	}
-}
+inline void LogInfo(fast_format::format_string<Args...> fmt, const Args&... args) { log_storage::Default().push_formatted(log_severity::Info, fmt, args...); }
 template<typename... Args>
-inline void LogWarning(std::format_string<Args...> fmt, Args&&... args) { 
-	auto *entry = log_storage::Default().push(log_severity::Warning); 
-	if (entry) {
-		entry->message.fill_formatted(fmt, std::forward<Args>(args)...);
-		//std::println("[Warning]: {}", entry->message.view);
-	}
-}
+inline void LogWarning(fast_format::format_string<Args...> fmt, const Args&... args) { log_storage::Default().push_formatted(log_severity::Warning, fmt, args...); }
 template<typename... Args>
-inline void LogError(std::format_string<Args...> fmt, Args&&... args) { 
-	auto *entry = log_storage::Default().push(log_severity::Error); 
-	if (entry) {
-		entry->message.fill_formatted(fmt, std::forward<Args>(args)...);
-		//std::println("[Error  ]: {}", entry->message.view);
-	}
-}
+inline void LogError(fast_format::format_string<Args...> fmt, const Args&... args) { log_storage::Default().push_formatted(log_severity::Error, fmt, args...); }
 template<typename... Args>
-inline void LogFatal(std::format_string<Args...> fmt, Args&&... args) { 
-	auto *entry = log_storage::Default().push(log_severity::Fatal); 
-	if (entry) {
-		entry->message.fill_formatted(fmt, std::forward<Args>(args)...);
-		//std::println("[Fatal  ]: {}", entry->message.view);
-	}
-}
+inline void LogFatal(fast_format::format_string<Args...> fmt, const Args&... args) { log_storage::Default().push_formatted(log_severity::Fatal, fmt, args...); }
 
 // ---------------------------------------------------------------------------------------
 // Static string logging
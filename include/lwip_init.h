@@ -64,7 +64,7 @@ inline struct netif* get_netif() {
 	static struct netif g_netif;
 	return &g_netif;
 }
-void wiznet_poll_task(void*) {
+inline void wiznet_poll_task(void*) {
 	for (;;) {
 		vTaskDelay(pdMS_TO_TICKS(1));
 		uint16_t pack_len{};
@@ -87,7 +87,7 @@ void wiznet_poll_task(void*) {
                     pbuf_free(p);
 	}
 }
-void init_cb(void* d) { 
+inline void init_cb(void* d) { 
 	xTaskNotifyGive((TaskHandle_t)d);
 }
 
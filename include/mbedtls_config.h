@@ -8,6 +8,9 @@
 
 /* mbed TLS modules */
 #define MBEDTLS_SHA256_C
+/* websocket handshake (Sec-WebSocket-Accept) */
+#define MBEDTLS_SHA1_C
+#define MBEDTLS_BASE64_C
 
 /* Enable required functions for SHA256 */
 #define MBEDTLS_MD_C
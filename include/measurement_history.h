@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+#include "mutex.h"
+#include "register_mapping.h"
+
+/** @brief channel of the measurement history, see measurement_history */
+template<typename T>
+struct history_channel {
+	float T::* member;
+	uint8_t decimals; // stored resolution is 10^-decimals
+	bool counter; // monotonic counter (eg. energy), keeps the last value of an interval instead of the average
+};
+
+/** @brief zigzag varint, at max 10 bytes */
+inline uint8_t* write_varint(uint8_t *out, int64_t v) {
+	uint64_t u = (uint64_t(v) << 1) ^ uint64_t(v >> 63);
+	for (; u >= 0x80; u >>= 7)
+		*out++ = uint8_t(u) | 0x80;
+	*out++ = uint8_t(u);
+	return out;
+}
+
+/**
+ * @brief Fixed memory time series of a few measurement values in three resolutions:
+ * 1 s samples for about 10 minutes, 1 min averages for about 24 hours and 15 min averages for about 30 days.
+ * Each resolution is a ring of blocks, when the ring is full the oldest block is overwritten. The block counts
+ * are sized for the typical compression of the meter values, noisy values shorten the covered time.
+ * Times are device times (seconds since boot), the history endpoint sends the unix time of the device time
+ * along so that clients can map them.
+ *
+ * Block layout (little endian):
+ * uint32_t start, device time of the first sample
+ * uint16_t count, amount of samples, sample i is at start + i * interval
+ * uint16_t size, used bytes of the block including this header
+ * per sample and channel a zigzag varint (7 bit groups, least significant first, msb set if a byte follows):
+ * the first sample of a block holds the values themselves, every following sample the difference to the previous value
+ * of the channel, for counter channels the difference to the previous difference. The difference before the second
+ * sample is 0, so the second sample of a counter channel is a plain difference.
+ * Values are integers in units of 10^-decimals.
+ * A block only holds consecutive samples, gaps (eg. meter not responding) start a new block.
+ * @usage
+ * inline constexpr std::array channels{history_channel{&halfs_sunspec::w, 0, false}};
+ * measurement_history<channels, eastron_sunspec_mapping> history{};
+ * history.add(values, time_us_64() / 1000000); // on every meter update
+ * history.read(history.minutes, from, to, dst, next);
+ */
+template<const auto &channels, const auto &mapping>
+struct measurement_history {
+	static constexpr int SIZE = channels.size();
+	static constexpr int BLOCK_SIZE = 256;
+	static constexpr int HEADER_SIZE = 8;
+	static constexpr int MAX_SAMPLE_SIZE = SIZE * 5; // quantized values are 32 bit, their differences at max 34 bit
+	static_assert(HEADER_SIZE + MAX_SAMPLE_SIZE <= BLOCK_SIZE);
+
+	static consteval std::array<int, SIZE> build_indices() {
+		std::array<int, SIZE> indices{};
+		for (int i = 0; i < SIZE; ++i)
+			indices[i] = mapped_registers<mapping>::index_of(channels[i].member);
+		return indices;
+	}
+	static constexpr std::array<int, SIZE> indices = build_indices();
+	static consteval std::array<float, SIZE> build_scales() {
+		std::array<float, SIZE> scales{};
+		for (int i = 0; i < SIZE; ++i) {
+			scales[i] = 1;
+			for (int d = 0; d < channels[i].decimals; ++d)
+				scales[i] *= 10;
+		}
+		return scales;
+	}
+	static constexpr std::array<float, SIZE> scales = build_scales();
+
+	struct sample {
+		uint32_t t{};
+		std::array<float, SIZE> values{};
+	};
+	struct block_header {
+		uint32_t start;
+		uint16_t count;
+		uint16_t size;
+	};
+
+	template<int BLOCKS>
+	struct tier {
+		uint32_t interval_s;
+		std::array<std::array<uint8_t, BLOCK_SIZE>, BLOCKS> blocks{};
+		int head{}; // block which is currently written
+		int used_blocks{};
+		// encoder state of the head block
+		block_header header{};
+		std::array<int32_t, SIZE> prev{};
+		std::array<int32_t, SIZE> prev_delta{};
+		// average of the currently accumulated interval
+		uint32_t acc_bucket{};
+		int acc_count{};
+		std::array<float, SIZE> acc{};
+
+		/** @brief accumulates s into the current interval
+		  * @return true if s started a new interval, the finished one is then stored and written to done */
+		bool add(const sample &s, sample &done) {
+			uint32_t bucket = s.t / interval_s;
+			bool finished = acc_count && bucket != acc_bucket;
+			if (finished) {
+				done.t = acc_bucket * interval_s;
+				for (int i = 0; i < SIZE; ++i)
+					done.values[i] = channels[i].counter ? acc[i]: acc[i] / acc_count;
+				append(done);
+				acc_count = 0;
+			}
+			if (acc_count == 0) {
+				acc_bucket = bucket;
+				acc = {};
+			}
+			for (int i = 0; i < SIZE; ++i)
+				acc[i] = channels[i].counter ? s.values[i]: acc[i] + s.values[i];
+			++acc_count;
+			return finished;
+		}
+		void append(const sample &s) {
+			bool consecutive = used_blocks && s.t == header.start + header.count * interval_s;
+			if (!consecutive || header.size + MAX_SAMPLE_SIZE > BLOCK_SIZE) {
+				if (used_blocks)
+					head = (head + 1) % BLOCKS;
+				used_blocks = std::min(used_blocks + 1, BLOCKS);
+				header = {.start = s.t, .count = 0, .size = HEADER_SIZE};
+				prev = {};
+				prev_delta = {};
+			}
+			uint8_t *out = blocks[head].data() + header.size;
+			for (int i = 0; i < SIZE; ++i) {
+				float scaled = s.values[i] * scales[i];
+				int32_t v = std::isfinite(scaled) && std::fabs(scaled) < INT32_MAX ? std::lrint(scaled): prev[i]; // invalid values repeat the previous one
+				int64_t delta = int64_t(v) - prev[i];
+				out = write_varint(out, channels[i].counter ? delta - prev_delta[i]: delta);
+				prev[i] = v;
+				prev_delta[i] = header.count ? delta: 0; // the first sample is absolute, not a difference
+			}
+			++header.count;
+			header.size = out - blocks[head].data();
+			std::memcpy(blocks[head].data(), &header, HEADER_SIZE);
+		}
+	};
+
+	// 48 KB of blocks, sized for the simulated meter data in which 48 minute blocks hold 27 h and 120 quarter blocks 31 days
+	tier<24> seconds{1};
+	tier<48> minutes{60};
+	tier<120> quarters{900};
+	mutex m{};
+
+	/** @brief adds a meter update at device time now_s, several updates within a second are averaged */
+	void add(const mapped_registers<mapping> &values, uint32_t now_s) {
+		sample s{.t = now_s};
+		for (int i = 0; i < SIZE; ++i)
+			s.values[i] = values.values[indices[i]];
+		sample second{}, minute{}, quarter{};
+		scoped_lock lock{m};
+		if (seconds.add(s, second) && minutes.add(second, minute))
+			quarters.add(minute, quarter);
+	}
+
+	/** @brief copies the blocks of t overlapping [from, to] in chronological order, as many as fit into dst
+	  * @param next set to the start of the first block which did not fit, 0 if all blocks were copied
+	  * @return amount of written bytes */
+	template<int BLOCKS>
+	int read(const tier<BLOCKS> &t, uint32_t from, uint32_t to, std::span<uint8_t> dst, uint32_t &next) {
+		scoped_lock lock{m};
+		int written{};
+		next = 0;
+		for (int b = t.used_blocks - 1; b >= 0; --b) {
+			const auto &block = t.blocks[(t.head - b + BLOCKS) % BLOCKS];
+			block_header h;
+			std::memcpy(&h, block.data(), HEADER_SIZE);
+			if (h.start > to || h.start + (h.count - 1) * t.interval_s < from)
+				continue;
+			if (written + h.size > int(dst.size())) {
+				next = h.start;
+				break;
+			}
+			std::memcpy(dst.data() + written, block.data(), h.size);
+			written += h.size;
+		}
+		return written;
+	}
+};
+
+/** @brief measurements kept in the history: power in W and energy counters in Wh */
+inline constexpr std::array measurement_history_channels{
+	history_channel{&halfs_sunspec::w, 0, false},
+	history_channel{&halfs_sunspec::wpha, 0, false},
+	history_channel{&halfs_sunspec::wphb, 0, false},
+	history_channel{&halfs_sunspec::wphc, 0, false},
+	history_channel{&halfs_sunspec::totwhimp, 0, true},
+	history_channel{&halfs_sunspec::totwhexp, 0, true},
+};
+
+/** @brief static ram the history may take, it sits next to the FreeRTOS heap, the lwip pools and the http buffers */
+constexpr int MEASUREMENT_HISTORY_RAM_BUDGET{50 * 1024};
+static_assert(sizeof(measurement_history<measurement_history_channels, eastron_sunspec_mapping>) <= MEASUREMENT_HISTORY_RAM_BUDGET,
+              "Measurement history exceeds its ram budget, shrink the tiers");
+
+namespace g {
+/** @brief fed by the meter task, read by the history endpoint */
+inline measurement_history<measurement_history_channels, eastron_sunspec_mapping>& history() {
+	static measurement_history<measurement_history_channels, eastron_sunspec_mapping> history{};
+	return history;
+}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <array>
+
+#include "static_types.h"
+#include "json_writer.h"
+#include "register_mapping.h"
+
+/** @brief json keys of the measurements, the values are taken from the mapped sunspec registers */
+inline constexpr std::array measurement_json_fields{
+	json_field{"neutral_volt_1", &halfs_sunspec::phvpha},
+	json_field{"neutral_volt_2", &halfs_sunspec::phvphb},
+	json_field{"neutral_volt3", &halfs_sunspec::phvphc},
+	json_field{"current_1", &halfs_sunspec::apha},
+	json_field{"current_2", &halfs_sunspec::aphb},
+	json_field{"current3", &halfs_sunspec::aphc},
+	json_field{"active_power_1", &halfs_sunspec::wpha},
+	json_field{"active_power_2", &halfs_sunspec::wphb},
+	json_field{"active_power3", &halfs_sunspec::wphc},
+	json_field{"apparent_power_1", &halfs_sunspec::vapha},
+	json_field{"apparent_power_2", &halfs_sunspec::vaphb},
+	json_field{"apparent_power3", &halfs_sunspec::vaphc},
+	json_field{"reactive_power_1", &halfs_sunspec::varpha},
+	json_field{"reactive_power_2", &halfs_sunspec::varphb},
+	json_field{"reactive_power3", &halfs_sunspec::varphc},
+	json_field{"power_factor_1", &halfs_sunspec::pfpha},
+	json_field{"power_factor_2", &halfs_sunspec::pfphb},
+	json_field{"power_factor3", &halfs_sunspec::pfphc},
+	json_field{"line_to_line_volt_1", &halfs_sunspec::ppvphab},
+	json_field{"line_to_line_volt_2", &halfs_sunspec::ppvphbc},
+	json_field{"line_to_line_volt3", &halfs_sunspec::ppvphca},
+	json_field{"avg_neutral_volt", &halfs_sunspec::phv},
+	json_field{"avg_current", &halfs_sunspec::a},
+	json_field{"tot_power", &halfs_sunspec::w},
+	json_field{"tot_apparent_power", &halfs_sunspec::va},
+	json_field{"tot_reactive_power", &halfs_sunspec::var},
+	json_field{"tot_power_factor", &halfs_sunspec::pf},
+	json_field{"frequency", &halfs_sunspec::hz},
+	json_field{"avg_line_to_line_volt", &halfs_sunspec::ppv},
+	json_field{"tot_importet_energy", &halfs_sunspec::totwhimp},
+	json_field{"to_exported_energy", &halfs_sunspec::totwhexp},
+};
+using measurement_json = json_writer<measurement_json_fields, eastron_sunspec_mapping>;
+
+/** @brief writes the current measurements as json object, shared by the /measurements endpoint and the event stream
+  * @return amount of written bytes */
+template<int N>
+int append_measurements_json(static_string<N> &s, const mapped_registers<eastron_sunspec_mapping> &m) {
+	return measurement_json{m}.append_to(s);
+}
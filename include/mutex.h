@@ -1,5 +1,8 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+
 #include "FreeRTOS.h"
 #include "semphr.h"
 
@@ -29,3 +32,33 @@ struct scoped_lock {
 	~scoped_lock() { if (handle) xSemaphoreGive(handle); }
 };
 
+
+/**
+ * @brief Double buffer for a single writer and any amount of readers (on both cores), nobody ever blocks.
+ * The writer fills the inactive buffer and publishes it by incrementing the sequence number.
+ * A reader only retries its copy if a publish happened in between, a writer being preempted
+ * while filling the inactive buffer does not affect the readers.
+ */
+template<typename T>
+struct double_buffer {
+	std::array<T, 2> buffers{};
+	std::atomic<uint32_t> seq{};
+
+	/** @note only a single task is allowed to publish */
+	void publish(const T &data) {
+		uint32_t s = seq.load(std::memory_order_relaxed);
+		buffers[(s + 1) & 1] = data;
+		seq.store(s + 1, std::memory_order_release);
+	}
+	/** @returns the sequence number of the copied data */
+	uint32_t read(T &out) const {
+		for (;;) {
+			uint32_t s = seq.load(std::memory_order_acquire);
+			out = buffers[s & 1];
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (seq.load(std::memory_order_relaxed) == s)
+				return s;
+		}
+	}
+	uint32_t sequence() const { return seq.load(std::memory_order_acquire); }
+};
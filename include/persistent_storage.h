@@ -1,9 +1,13 @@
 #pragma once
 
-#include <cmath>
+#include <algorithm>
+#include <atomic>
 #include <span>
 #include <cstring>
 
+#include "FreeRTOS.h"
+#include "task.h"
+
 #include "pico/flash.h"
 #include "pico/stdlib.h"
 #include "hardware/flash.h"
@@ -15,7 +19,7 @@ constexpr uint32_t FLASH_SIZE{PICO_FLASH_SIZE_BYTES};
 
 /** 
  * @brief Add new members always at the front and leave the ones in the back the same
- * as the elements at the back of the layout always stay in the same position
+ * as the members are stored with their distance to the end of the layout as key
  */
 struct persistent_storage_layout {
 	static_string<64> user_pwd;
@@ -26,10 +30,33 @@ struct persistent_storage_layout {
 
 static char *flash_begin{reinterpret_cast<char*>(uintptr_t(XIP_BASE))};
 
+/** @brief crc32 (ieee 802.3, same as zlib) */
+constexpr uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc = 0) {
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i) {
+		crc ^= data[i];
+		for (int b = 0; b < 8; ++b)
+			crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1)));
+	}
+	return ~crc;
+}
+
 /** 
  * @brief  strcut to easily access/setup permanent storage with a static size and lots of compile time validations.
- * Sets up the storage at the very end of the memory range and acquires as many bytes as needed for the persistent_mem_layout struct
- * to fit
+ * The values live in a ram image of the persistent_mem_layout struct, writes only update the image and are appended
+ * by the writer_task() on request_commit() (or once no write happened for COMMIT_DELAY_US) as records to a log in
+ * SECTORS rotating flash sectors at the very end of the flash. This way http handlers and the modbus tasks never
+ * wait for the flash, the image lock is not held while programming or erasing.
+ *
+ * sector: uint32_t magic ("PKV1", the digit is the format version), uint32_t seq (incremented for each started sector)
+ * record: uint16_t key (distance of the written bytes to the end of the layout), uint16_t size, uint32_t seq (incremented
+ *         for each record), uint32_t crc32 over key, size, seq and the data, followed by size bytes data
+ * A commit is programmed in whole pages, an erased key (0xffff) skips to the next page, at a page start it ends the sector.
+ * If a commit does not fit into the current sector, the next sector is erased and gets the whole image as first record
+ * (garbage collection), so that all sectors are erased equally often and a commit only erases every few commits.
+ * On load all sectors are scanned once in the order of their seq and the valid records are applied to the image,
+ * a record with wrong crc (eg. power loss while programming) ends the scan of its sector.
+ * If no sector is found, the image is taken over from the fixed offset layout of earlier versions at the end of the flash.
  * @usage
  * The usage is normally as follows:
  *
@@ -51,42 +78,60 @@ static char *flash_begin{reinterpret_cast<char*>(uintptr_t(XIP_BASE))};
  * int mem_b;
  * persistent_storage_t::Default().write(mem_b, &layout::storage_b);
  * persistent_storage_t::Default().read(&layout::storage_b, mem_b);
+ *
+ * # writing the changes to flash in the writer task, else done once no write happened for COMMIT_DELAY_US
+ * persistent_storage_t::Default().request_commit();
+ *
+ * # the writer task, started once after the initialization
+ * xTaskCreate(persistent_storage_t::writer_task, "FlashWriter", 256, NULL, 1, NULL);
  */
 
-template<typename persistent_mem_layout, int MAX_WRITE_SIZE = 2 * FLASH_SECTOR_SIZE>
+template<typename persistent_mem_layout, int SECTORS = 4>
 struct persistent_storage {
-	static constexpr uint32_t begin_offset{FLASH_SIZE - sizeof(persistent_mem_layout)}; // flash page alignment is done only when writing
-	const char *storage_begin{flash_begin + begin_offset};
-	const char *storage_end{flash_begin + FLASH_SIZE}; // 2MB after flash start is end
+	static constexpr uint32_t begin_offset{FLASH_SIZE - SECTORS * FLASH_SECTOR_SIZE};
+	static constexpr uint32_t legacy_offset{FLASH_SIZE - sizeof(persistent_mem_layout)}; // fixed offset layout of earlier versions
+	static constexpr uint32_t MAGIC{0x31564b50};
+	static constexpr int SECTOR_HEADER_SIZE{8};
+	static constexpr int RECORD_HEADER_SIZE{12};
+	static constexpr uint16_t ERASED_KEY{0xffff};
+	static constexpr int MAX_DIRTY{8};
+	static constexpr int MAX_COMMIT_SIZE = (SECTOR_HEADER_SIZE + (MAX_DIRTY + 1) * RECORD_HEADER_SIZE + sizeof(persistent_mem_layout) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+	static constexpr uint64_t COMMIT_DELAY_US{2'000'000};
+	static constexpr uint32_t WRITER_PERIOD_MS{500};
+	static_assert(sizeof(persistent_mem_layout) < ERASED_KEY && MAX_COMMIT_SIZE <= FLASH_SECTOR_SIZE);
 
 	static persistent_storage& Default() {
 		static persistent_storage p{};
+		[[maybe_unused]] static bool loaded = [](){ p._load(); return true; }();
 		return p;
 	}
 
 	mutex _memory_mutex{};
-	std::array<char, MAX_WRITE_SIZE> _write_buffer{};
+	mutex _commit_mutex{}; // serializes the flash writes and guards the sector state below
+	std::array<char, sizeof(persistent_mem_layout)> _image{};
+	struct _range { uint16_t begin, end; };
+	static_vector<_range, MAX_DIRTY> _dirty{}; // not yet committed ranges of the image
+	uint64_t _last_write_us{};
+	int _head{-1}; // sector which is appended to
+	uint32_t _head_seq{};
+	int _write_pos{}; // page aligned append position in the head sector
+	uint32_t _record_seq{};
+	std::array<uint8_t, MAX_COMMIT_SIZE> _program_buffer{};
+	TaskHandle_t _writer{};
+	// commit status, see committed()
+	std::atomic<uint32_t> requested_commits{};
+	std::atomic<uint32_t> completed_commits{};
+	std::atomic<err_t> last_commit_result{PICO_OK};
 
 	template<typename M>
 	using mem_t = std::decay_t<decltype(std::declval<persistent_mem_layout>().*std::declval<M>())>;
 
 	/** @brief To be used with member pointers: int Struct:: *member = &Struct::member_a; */
-	template<typename M, typename T = mem_t<M>> requires (std::islessequal(sizeof(T), MAX_WRITE_SIZE))
+	template<typename M, typename T = mem_t<M>>
 	err_t write(const T &data, M member) {
-		#pragma GCC diagnostic push
-		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
-		uint32_t start_idx_data = begin_offset + *reinterpret_cast<uintptr_t*>(&member);
-		uint32_t start_idx_paged = start_idx_data / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
-		uint32_t end_idx_data = start_idx_data + sizeof(T);
-		uint32_t end_idx_paged = (end_idx_data + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
-		if (end_idx_paged - start_idx_paged > MAX_WRITE_SIZE) {
-			LogError("persistent_storage::write() too large data to write, abort.");
-			return PICO_ERROR_GENERIC;
-		}
 		scoped_lock lock{_memory_mutex};
-		memcpy(_write_buffer.data() + start_idx_data - start_idx_paged, &data, sizeof(T));
-		#pragma GCC diagnostic pop
-		return _write_impl(start_idx_paged, start_idx_data, end_idx_data, end_idx_paged);
+		_stage(_member_offset(member), &data, sizeof(T));
+		return PICO_OK;
 	}
 	/** @brief Range based write overload, see write() for usage. Size has to be given in bytes written */
 	template<typename M, typename T = mem_t<M>::value_t>
@@ -97,101 +142,226 @@ struct persistent_storage {
 			LogError("persistent_storage::write() indices out of bounds, abort.");
 			return PICO_ERROR_GENERIC;
 		}
-		#pragma GCC diagnostic push
-		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
-		uint32_t start_idx_data = begin_offset + *reinterpret_cast<uintptr_t*>(&member) + start_idx * sizeof(T);
-		uint32_t start_idx_paged = start_idx_data / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
-		uint32_t end_idx_data = start_idx_data + sizeof(T) * (end_idx - start_idx);
-		uint32_t end_idx_paged = (end_idx_data + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
-		if (end_idx_paged - start_idx_paged > MAX_WRITE_SIZE) {
-			LogError("persistent_storage::write() too large data to write, abort.");
-			return PICO_ERROR_GENERIC;
-		}
-		LogInfo("before lock write_array_range");
 		scoped_lock lock{_memory_mutex};
-		LogInfo("after lock");
-		memcpy(_write_buffer.data() + start_idx_data - start_idx_paged, data, end_idx_data - start_idx_data);
-		#pragma GCC diagnostic pop
-		return _write_impl(start_idx_paged, start_idx_data, end_idx_data, end_idx_paged);
+		_stage(_member_offset(member) + start_idx * sizeof(T), data, sizeof(T) * (end_idx - start_idx));
+		return PICO_OK;
 	}
-	template<typename M, typename T = mem_t<M>> requires (std::islessequal(sizeof(T), MAX_WRITE_SIZE))
+	template<typename M, typename T = mem_t<M>>
 	void read(M member, T& out) const {
-		// read is a simple copy from flash memory
-		#pragma GCC diagnostic push
-		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
 		scoped_lock lock{_memory_mutex};
-		memcpy(&out, storage_begin + *reinterpret_cast<uintptr_t*>(&member), sizeof(T));
-		#pragma GCC diagnostic pop
+		memcpy(&out, _image.data() + _member_offset(member), sizeof(T));
 	}
 	template<typename M, typename T = mem_t<M>::value_type>
 	void read_array_range(M member, uint32_t start_idx, uint32_t end_idx, T* out) const {
-		// read is a simple copy from flash memory
-		#pragma GCC diagnostic push
-		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
 		scoped_lock lock{_memory_mutex};
-		memcpy(out, storage_begin + *reinterpret_cast<uintptr_t*>(&member) + start_idx * sizeof(T), sizeof(T) * (end_idx - start_idx));
-		#pragma GCC diagnostic pop
+		memcpy(out, _image.data() + _member_offset(member) + start_idx * sizeof(T), sizeof(T) * (end_idx - start_idx));
 	}
 	template<typename M, typename T = mem_t<M>>
 	const T& view(M member) const {
-		#pragma GCC diagnostic push
-		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
-		scoped_lock lock{_memory_mutex};
-		return *reinterpret_cast<const T*>(storage_begin + *reinterpret_cast<uintptr_t*>(&member));
-		#pragma GCC diagnostic pop
+		return *reinterpret_cast<const T*>(_image.data() + _member_offset(member));
 	}
 	template<typename M, typename T = mem_t<M>::value_type>
 	std::span<T> view(M member, uint32_t start_idx, uint32_t end_idx) const {
-		#pragma GCC diagnostic push
-		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
-		scoped_lock lock{_memory_mutex};
-		return {(T*)(storage_begin + *reinterpret_cast<uintptr_t*>(&member) + start_idx * sizeof(T)), end_idx - start_idx};
-		#pragma GCC diagnostic pop
+		return {(T*)(_image.data() + _member_offset(member) + start_idx * sizeof(T)), end_idx - start_idx};
 	}
 
-	/*INTERNAL*/ struct _write_data {const char *src_start, *src_end; uint32_t dst_offset;}; // dst offset is the offset of the flash begin
-	/*INTERNAL*/ err_t _write_impl(uint32_t start_paged, uint32_t start_data, uint32_t end_data, uint32_t end_paged) {
-		if (start_data != start_paged)
-			memcpy(_write_buffer.data(), flash_begin + start_paged, start_data - start_paged);	
-		if (end_data != end_paged)
-			memcpy(_write_buffer.data() + end_data - start_paged, flash_begin + end_data, end_paged - end_data);	
-		_write_data write_data{.src_start = _write_buffer.data(), 
-					.src_end = _write_buffer.data() + end_paged - start_paged, 
-					.dst_offset = start_paged};
-		// first erase as flash_range_program only allows to change 1s to 0s, but not the other way around
-		int r = flash_safe_execute(_flash_erase, (void*)&write_data, UINT32_MAX);
-		if (r != PICO_OK)
-			LogError("Failed to erase data persistent: {}", r);
-		r = flash_safe_execute(_flash_program, (void*)&write_data, UINT32_MAX);
-		if (r != PICO_OK)
+	/** @brief lets the writer task commit the uncommitted writes, returns immediately.
+	  * Commits synchronously if the writer task is not running yet
+	  * @return sequence number of the request, committed(seq) tells when it is done */
+	uint32_t request_commit() {
+		uint32_t seq = ++requested_commits;
+		if (_writer)
+			xTaskNotifyGive(_writer);
+		else
+			commit();
+		return seq;
+	}
+	/** @return true if the commit request seq is done, the result of the last commit is in last_commit_result */
+	bool committed(uint32_t seq) const { return int32_t(completed_commits - seq) >= 0; }
+
+	/** @brief appends the uncommitted writes to the flash log, blocks for the flash write.
+	  * Only the writer task and code running before it should use this, everything else request_commit() */
+	err_t commit() {
+		scoped_lock commit_lock{_commit_mutex};
+		uint32_t requested = requested_commits;
+		_write_data write_data{};
+		{
+			scoped_lock lock{_memory_mutex};
+			if (!_prepare_commit(write_data)) {
+				completed_commits = requested;
+				return PICO_OK;
+			}
+		}
+		int r = flash_safe_execute(_flash_write, (void*)&write_data, UINT32_MAX);
+		if (r != PICO_OK) {
 			LogError("Failed to write data persistent: {}", r);
-		return PICO_OK;
+			scoped_lock lock{_memory_mutex};
+			_mark_dirty(0, _image.size()); // the records might be partially written, the next commit starts a new sector
+			_write_pos = FLASH_SECTOR_SIZE;
+			last_commit_result = PICO_ERROR_GENERIC;
+		} else {
+			if (write_data.erase) {
+				_head = (_head + 1) % SECTORS;
+				++_head_seq;
+				_write_pos = 0;
+			}
+			_write_pos += write_data.size;
+			last_commit_result = PICO_OK;
+		}
+		completed_commits = requested;
+		return last_commit_result;
 	}
-	/*INTERNAL*/ static void __no_inline_not_in_flash_func(_flash_erase)(void *d) {
-		const _write_data &data = *reinterpret_cast<const _write_data*>(d);
-		const uint32_t write_size = data.src_end - data.src_start;
-		if (write_size % FLASH_SECTOR_SIZE != 0) {
-			LogError("_flash_erase(): write range must be a multiple of the FLASH_SECTOR_SIZE. Ignoreing write");
-			return;
+	/** @brief commits if there are uncommitted writes and the last one is at least COMMIT_DELAY_US ago */
+	err_t commit_if_due(uint64_t now_us) {
+		{
+			scoped_lock lock{_memory_mutex};
+			if (_dirty.empty() || now_us - _last_write_us < COMMIT_DELAY_US)
+				return PICO_OK;
 		}
-		if (write_size + data.dst_offset > FLASH_SIZE) {
-			LogError("_flash_erase(): write range overflows storage. Ignoring write.");
-			return;
+		return commit();
+	}
+	/** @brief low priority task doing all flash writes of the storage, woken by request_commit() */
+	static void writer_task(void *) {
+		LogInfo("Persistent storage writer task started");
+		persistent_storage &p = Default();
+		p._writer = xTaskGetCurrentTaskHandle();
+		for (;;) {
+			ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(WRITER_PERIOD_MS));
+			if (!p.committed(p.requested_commits))
+				p.commit();
+			else
+				p.commit_if_due(time_us_64());
 		}
-		flash_range_erase(data.dst_offset, write_size);
 	}
-	/*INTERNAL*/ static void __no_inline_not_in_flash_func(_flash_program)(void *d) {
-		const _write_data &data = *reinterpret_cast<const _write_data*>(d);
-		const uint32_t write_size = data.src_end - data.src_start;
-		if (write_size % FLASH_SECTOR_SIZE != 0) {
-			LogError("_flash_program(): write range must be a multiple of the FLASH_SECTOR_SIZE. Ignoreing write");
+
+	/*INTERNAL*/ template<typename M>
+	static uint32_t _member_offset(M member) {
+		#pragma GCC diagnostic push
+		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+		return *reinterpret_cast<uintptr_t*>(&member);
+		#pragma GCC diagnostic pop
+	}
+	/*INTERNAL*/ static const char* _sector_begin(int i) { return flash_begin + begin_offset + i * FLASH_SECTOR_SIZE; }
+	/*INTERNAL*/ void _stage(uint32_t offset, const void *data, uint32_t size) {
+		if (memcmp(_image.data() + offset, data, size) == 0)
 			return;
+		memcpy(_image.data() + offset, data, size);
+		_mark_dirty(offset, offset + size);
+		_last_write_us = time_us_64();
+	}
+	/*INTERNAL*/ void _mark_dirty(uint32_t begin, uint32_t end) {
+		_dirty.remove_if([&](const _range &r) {
+			if (r.end < begin || r.begin > end)
+				return false;
+			begin = std::min<uint32_t>(begin, r.begin);
+			end = std::max<uint32_t>(end, r.end);
+			return true;
+		});
+		if (!_dirty.push(_range{uint16_t(begin), uint16_t(end)})) { // too many ranges, the whole image is written
+			_dirty.clear();
+			_dirty.push(_range{0, uint16_t(_image.size())});
+		}
+	}
+	/** @brief replays the records of all sectors in the order of their seq into the image */
+	/*INTERNAL*/ void _load() {
+		_image.fill(0xff);
+		std::array<uint32_t, SECTORS> seqs{};
+		for (int i = 0; i < SECTORS; ++i) {
+			uint32_t header[2];
+			memcpy(header, _sector_begin(i), sizeof(header));
+			seqs[i] = header[0] == MAGIC ? header[1]: 0;
+		}
+		for (;;) {
+			int next{-1};
+			for (int i = 0; i < SECTORS; ++i)
+				if (seqs[i] && (next < 0 || seqs[i] < seqs[next]))
+					next = i;
+			if (next < 0)
+				break;
+			_head = next;
+			_head_seq = seqs[next];
+			_write_pos = _scan_sector(next);
+			seqs[next] = 0;
 		}
-		if (write_size + data.dst_offset > FLASH_SIZE) {
-			LogError("_flash_program(): write range overflows storage. Ignoring write.");
+		if (_head < 0) {
+			LogInfo("No persistent storage log found, taking over the fixed layout");
+			memcpy(_image.data(), flash_begin + legacy_offset, _image.size());
+			_mark_dirty(0, _image.size());
 			return;
 		}
-		flash_range_program(data.dst_offset, reinterpret_cast<const uint8_t*>(data.src_start), write_size);
+		LogInfo("Loaded persistent storage, sector {} seq {} records {}", _head, _head_seq, _record_seq);
+	}
+	/** @return page aligned end of the records, the sector size if an invalid record was found */
+	/*INTERNAL*/ int _scan_sector(int sector) {
+		const uint8_t *data = reinterpret_cast<const uint8_t*>(_sector_begin(sector));
+		int pos = SECTOR_HEADER_SIZE;
+		while (pos + RECORD_HEADER_SIZE <= int(FLASH_SECTOR_SIZE)) {
+			uint16_t key, size;
+			uint32_t seq, crc;
+			memcpy(&key, data + pos, 2);
+			memcpy(&size, data + pos + 2, 2);
+			memcpy(&seq, data + pos + 4, 4);
+			memcpy(&crc, data + pos + 8, 4);
+			if (key == ERASED_KEY) {
+				if (pos % FLASH_PAGE_SIZE == 0)
+					break;
+				pos = (pos / FLASH_PAGE_SIZE + 1) * FLASH_PAGE_SIZE;
+				continue;
+			}
+			if (pos + RECORD_HEADER_SIZE + size > int(FLASH_SECTOR_SIZE) ||
+			    crc != crc32(data + pos + RECORD_HEADER_SIZE, size, crc32(data + pos, 8))) {
+				LogWarning("Invalid persistent storage record in sector {} at {}", sector, pos);
+				return FLASH_SECTOR_SIZE; // nothing is appended behind, the next commit starts a new sector
+			}
+			if (key <= _image.size() && size <= key) // keys of removed members are skipped
+				memcpy(_image.data() + _image.size() - key, data + pos + RECORD_HEADER_SIZE, size);
+			_record_seq = std::max(_record_seq, seq);
+			pos += RECORD_HEADER_SIZE + size;
+		}
+		return std::min<int>((pos + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE, FLASH_SECTOR_SIZE);
+	}
+	/*INTERNAL*/ int _write_record(int pos, uint32_t begin, uint32_t end) {
+		uint16_t key = _image.size() - begin, size = end - begin;
+		uint32_t seq = ++_record_seq;
+		uint8_t *out = _program_buffer.data() + pos;
+		memcpy(out, &key, 2);
+		memcpy(out + 2, &size, 2);
+		memcpy(out + 4, &seq, 4);
+		memcpy(out + RECORD_HEADER_SIZE, _image.data() + begin, size);
+		uint32_t crc = crc32(out + RECORD_HEADER_SIZE, size, crc32(out, 8));
+		memcpy(out + 8, &crc, 4);
+		return pos + RECORD_HEADER_SIZE + size;
+	}
+	/*INTERNAL*/ struct _write_data { uint32_t offset; const uint8_t *src; uint32_t size; bool erase; };
+	/** @brief moves the dirty ranges as records into the program buffer, called with both locks held
+	  * @return false if there is nothing to write */
+	/*INTERNAL*/ bool _prepare_commit(_write_data &write_data) {
+		if (_dirty.empty())
+			return false;
+		int size{};
+		for (const _range &r: _dirty)
+			size += RECORD_HEADER_SIZE + r.end - r.begin;
+		_program_buffer.fill(0xff);
+		if (_head >= 0 && _write_pos + size <= int(FLASH_SECTOR_SIZE)) {
+			int end{};
+			for (const _range &r: _dirty)
+				end = _write_record(end, r.begin, r.end);
+			write_data = {.offset = begin_offset + _head * FLASH_SECTOR_SIZE + _write_pos, .src = _program_buffer.data(), .size = uint32_t(end), .erase = false};
+		} else { // next sector, starts with the whole image
+			uint32_t header[2]{MAGIC, _head_seq + 1};
+			memcpy(_program_buffer.data(), header, sizeof(header));
+			int end = _write_record(SECTOR_HEADER_SIZE, 0, _image.size());
+			write_data = {.offset = begin_offset + (_head + 1) % SECTORS * FLASH_SECTOR_SIZE, .src = _program_buffer.data(), .size = uint32_t(end), .erase = true};
+		}
+		write_data.size = (write_data.size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE * FLASH_PAGE_SIZE;
+		_dirty.clear();
+		return true;
+	}
+	/*INTERNAL*/ static void __no_inline_not_in_flash_func(_flash_write)(void *d) {
+		const _write_data &data = *reinterpret_cast<const _write_data*>(d);
+		if (data.erase)
+			flash_range_erase(data.offset / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+		flash_range_program(data.offset, data.src, data.size);
 	}
 };
 
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/**
+ * @brief Scheduler for reading register blocks of a remote modbus device, each block with its own interval.
+ * Blocks which are due at the same time and lie close to each other are coalesced into a single
+ * read request (reading a few unused registers in between is cheaper than a further request on a 9600 baud line).
+ * @note The blocks have to be given sorted by their register address
+ * @usage
+ * poll_scheduler<halfs_eastron, 2> scheduler{{{
+ * 	{&halfs_eastron::phase_1_neutral_volts, &halfs_eastron::phase_3_power_factor, 0},  // every cycle
+ * 	{&halfs_eastron::import_active_energy, &halfs_eastron::export_active_energy, 10'000}, // every 10 seconds
+ * }}};
+ * for (;;)
+ * 	scheduler.poll(modbus_actor, device_address, time_us_64() / 1000);
+ */
+template<typename halfs_t, int N>
+struct poll_scheduler {
+	using member_t = float halfs_t::*;
+	static constexpr uint32_t MAX_REGISTERS{125}; // max register count for a single modbus read request
+	static constexpr uint32_t MAX_GAP_REGISTERS{16}; // max amount of unused registers which are read to merge two blocks
+
+	struct block {
+		member_t first;
+		member_t last; // inclusive
+		uint32_t interval_ms; // 0 means polled in every cycle
+		uint64_t next_due_ms{};
+	};
+	std::array<block, N> blocks;
+
+	static uint32_t register_idx(member_t member) {
+		#pragma GCC diagnostic push
+		#pragma GCC diagnostic ignored "-Wstrict-aliasing"
+		return *reinterpret_cast<uintptr_t*>(&member) / 2;
+		#pragma GCC diagnostic pop
+	}
+	static uint32_t register_end(member_t member) { return register_idx(member) + sizeof(float) / 2; }
+
+	/** @brief Reads all blocks that are due at now_ms with as few read requests as possible
+	  * @return amount of issued read requests, 0 if nothing was due */
+	template<typename actor_t>
+	int poll(actor_t &actor, int device_address, uint64_t now_ms) {
+		int requests{};
+		for (int i = 0; i < N; ) {
+			if (blocks[i].next_due_ms > now_ms) {
+				++i;
+				continue;
+			}
+			member_t first = blocks[i].first;
+			member_t last = blocks[i].last;
+			_reschedule(blocks[i], now_ms);
+			for (++i; i < N; ++i) {
+				if (blocks[i].next_due_ms > now_ms)
+					continue;
+				if (register_idx(blocks[i].first) - register_end(last) > MAX_GAP_REGISTERS ||
+				    register_end(blocks[i].last) - register_idx(first) > MAX_REGISTERS)
+					break;
+				last = blocks[i].last;
+				_reschedule(blocks[i], now_ms);
+			}
+			actor.read_remote(device_address, first, last);
+			++requests;
+		}
+		return requests;
+	}
+
+	/*INTERNAL*/ static void _reschedule(block &b, uint64_t now_ms) {
+		b.next_due_ms += b.interval_ms;
+		if (b.next_due_ms <= now_ms) // skipping missed slots avoids bursts after long bus timeouts
+			b.next_due_ms = now_ms + b.interval_ms;
+	}
+};
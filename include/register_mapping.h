@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <utility>
+
+#include <modbus-layouts.h>
+
+/**
+ * @brief Staging values for a register_mapping table (see modbus-layouts.h).
+ * The table is a template parameter, so the copy loops are unrolled at compile time
+ * and every read/write is done with a constant member offset.
+ * @usage
+ * mapped_registers<eastron_sunspec_mapping> values{};
+ * values.read_from(eastron_actor);
+ * values.write_to(sunspec_actor);
+ * float power = values.get<&halfs_sunspec::w>();
+ */
+template<const auto &mapping>
+struct mapped_registers {
+	static constexpr int SIZE = mapping.size();
+	std::array<float, SIZE> values{};
+
+	/** @brief reads and scales all source registers of the mapping */
+	template<typename actor_t>
+	void read_from(actor_t &src) {
+		[&]<size_t... I>(std::index_sequence<I...>) {
+			((values[I] = src.read(mapping[I].src) * mapping[I].scale), ...);
+		}(std::make_index_sequence<SIZE>{});
+	}
+	/** @brief writes all values to the destination registers of the mapping */
+	template<typename actor_t>
+	void write_to(actor_t &dst) const {
+		[&]<size_t... I>(std::index_sequence<I...>) {
+			(dst.write(values[I], mapping[I].dst), ...);
+		}(std::make_index_sequence<SIZE>{});
+	}
+	/** @brief value of a destination register, the index lookup is done at compile time */
+	template<auto dst_member>
+	float get() const {
+		constexpr int i = index_of(dst_member);
+		return values[i];
+	}
+	static consteval int index_of(auto dst_member) {
+		for (int i = 0; i < SIZE; ++i)
+			if (mapping[i].dst == dst_member)
+				return i;
+		throw "Register is not contained in the mapping";
+	}
+};
+
+/**
+ * @brief Mapped values together with the update sequence number of the last change of each value.
+ * Allows readers to transfer only the values which changed since a sequence number they already have.
+ * @usage
+ * tracked.update(values);
+ * uint32_t changed = tracked.changed_since(client_seq); // bit i set if values[i] changed
+ */
+template<const auto &mapping>
+struct tracked_registers {
+	static constexpr int SIZE = mapping.size();
+	static_assert(SIZE <= 32, "Changes are reported as 32 bit mask");
+	mapped_registers<mapping> registers{};
+	std::array<uint32_t, SIZE> changed_seq{};
+	uint32_t seq{}; // incremented with each update, the first update marks all values as changed
+
+	void update(const mapped_registers<mapping> &values) {
+		++seq;
+		for (int i = 0; i < SIZE; ++i) {
+			if (seq != 1 && values.values[i] == registers.values[i])
+				continue;
+			registers.values[i] = values.values[i];
+			changed_seq[i] = seq;
+		}
+	}
+	/** @return bit per value changed after since_seq, all values if since_seq is newer than seq (eg. after a reboot) */
+	uint32_t changed_since(uint32_t since_seq) const {
+		uint32_t changed{};
+		for (int i = 0; i < SIZE; ++i)
+			if (since_seq > seq || changed_seq[i] > since_seq)
+				changed |= 1u << i;
+		return changed;
+	}
+};
@@ -1,8 +1,10 @@
 #pragma once
 
 #include <array>
+#include <span>
 #include <string_view>
-#include <format>
+
+#include "fast_format.h"
 
 template<int N>
 struct static_string {
@@ -30,19 +32,21 @@ struct static_string {
 		storage[cur_size++] = c;
 	}
 	template<typename... Args>
-	constexpr int fill_formatted(std::format_string<Args...> fmt, Args&&... args) { 
-		auto info = std::format_to_n(storage.data(), storage.size(), fmt, std::forward<Args>(args)...); 
-		cur_size = info.size;
+	constexpr int fill_formatted(fast_format::format_string<Args...> fmt, const Args&... args) { 
+		cur_size = fast_format::format_to(storage.data(), storage.size(), fmt, args...);
 		return cur_size;
 	}
 	template<typename... Args>
-	constexpr int append_formatted(std::format_string<Args...> fmt, Args&&... args) { 
-		int write_size = storage.size() - cur_size;
-		auto info = std::format_to_n(storage.data() + cur_size, write_size, fmt, std::forward<Args>(args)...); 
-		write_size = std::min(info.size, write_size); 
+	constexpr int append_formatted(fast_format::format_string<Args...> fmt, const Args&... args) { 
+		int write_size = fast_format::format_to(storage.data() + cur_size, storage.size() - cur_size, fmt, args...);
 		cur_size += write_size;
 		return write_size;
 	}
+	/** @brief appends the integer without going through the format string parsing */
+	template<std::integral T>
+	constexpr int append_int(T v) { int s = fast_format::write_int(storage.data() + cur_size, storage.size() - cur_size, v); cur_size += s; return s; }
+	/** @brief appends the float with a fixed amount of decimals, same as append_formatted("{:.2f}", v) for decimals = 2 */
+	int append_fixed(double v, int decimals = 2) { int s = fast_format::write_float(storage.data() + cur_size, storage.size() - cur_size, v, decimals); cur_size += s; return s; }
 	constexpr const char* data() const { return storage.data(); }
 	constexpr char* data() { return storage.data(); }
 	constexpr const char* end() const { return storage.data() + cur_size; }
@@ -112,16 +116,16 @@ struct static_ring_buffer {
 };
 
 template<int N, typename... Args>
-static std::string_view static_format(std::format_string<Args...> fmt, Args&&... args) {
+static std::string_view static_format(fast_format::format_string<Args...> fmt, const Args&... args) {
 	static static_string<N> string{};
-	string.fill_formatted(fmt, std::forward<Args>(args)...);
+	string.fill_formatted(fmt, args...);
 	return string.sv();
 }
 
 template<typename... Args>
-static int format_to_sv(std::string_view dest, std::format_string<Args...> fmt, Args&&... args) {
+static int format_to_sv(std::string_view dest, fast_format::format_string<Args...> fmt, const Args&... args) {
 	if (!dest.data())
 		return 0;
-	return std::format_to_n(const_cast<char*>(dest.data()), dest.size(), fmt, std::forward<Args>(args)...).size;
+	return fast_format::format_to(const_cast<char*>(dest.data()), dest.size(), fmt, args...);
 }
 
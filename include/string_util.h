@@ -1,5 +1,8 @@
 #pragma once
 
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
 #include <string_view>
 
 /** @brief Extract a word from the beginning of content, never reading over newlines.
@@ -52,3 +55,23 @@ inline std::string_view extract_line(std::string_view &content) {
 		content = content.substr(whitespace);
 	return extract_until_newline(content);
 }
+/** @brief Value of the parameter key in a url query string (key=value&key2=value2),
+ *  empty if the key is not contained */
+inline std::string_view query_param(std::string_view query, std::string_view key) {
+	while (query.size()) {
+		std::string_view param = query.substr(0, query.find('&'));
+		query = query.substr(std::min(param.size() + 1, query.size()));
+		if (param.size() > key.size() && param.starts_with(key) && param[key.size()] == '=')
+			return param.substr(key.size() + 1);
+	}
+	return {};
+}
+/** @brief parses the decimal parameter key of a url query string into value, value is unchanged if the key is not contained
+ *  @return false if the parameter is contained but no valid number */
+inline bool query_param(std::string_view query, std::string_view key, uint32_t &value) {
+	std::string_view param = query_param(query, key);
+	if (param.empty())
+		return true;
+	auto [end, ec] = std::from_chars(param.data(), param.data() + param.size(), value);
+	return ec == std::errc{} && end == param.data() + param.size();
+}
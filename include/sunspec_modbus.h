@@ -4,31 +4,66 @@
 #include <modbus-actor.h>
 
 #include "lwip/tcp.h"
+#include "pico/time.h"
 
 #include "mutex.h"
+#include "register_mapping.h"
 
 #include <log_storage.h>
 #include <ranges_util.h>
+#include <lwip_init.h>
 
 namespace ls = libmodbus_static;
 
 err_t close_socket(struct tcp_pcb *& socket);
 err_t tcp_server_accept (void *arg, struct tcp_pcb *client_pcb, err_t err);
 
+/**
+ * @brief Modbus tcp transport serving up to 8 clients.
+ * Every connection keeps the received pbuf chain (no copy in the recv callback), which can contain
+ * several pipelined requests and frames split over or coalesced into segments.
+ * read_bytes() hands out a single mbap frame at a time and serves the connections round robin,
+ * so a client with many queued requests does not block the others. The slot, its generation and the
+ * transaction id of the handed out frame are remembered and write_bytes() only sends a response with
+ * matching id to the slot if it still holds the connection the request came from.
+ * Connections stay open until they were idle for idle_timeout_ms, if all slots are taken
+ * the least recently active connection is evicted for a new client.
+ */
 struct tcp_io {
 	static constexpr ls::transport_t TRANSPORT_TYPE{ls::transport_t::TCP};
+	static constexpr int MBAP_HEADER_SIZE{6}; // transaction id, protocol id, length (unit id is counted in length)
+	static constexpr int MAX_FRAME_SIZE{MBAP_HEADER_SIZE + 254};
+	static constexpr int MAX_QUEUED_BYTES{1024}; // per connection, more data is refused and redelivered by lwip later
 
 	const uint16_t port{502};
 
+	/** @brief slots are stable, a connection is given to lwip as callback arg */
 	struct connection {
-		struct tcp_pcb* client_socket{};
-		static_vector<uint8_t, 1024> buffer{};
+		tcp_io *io{};
+		struct tcp_pcb* client_socket{}; // nullptr for a free slot
+		struct pbuf* rx_chain{}; // received but not yet consumed data, references are released once a frame is consumed
+		uint32_t last_activity_ms{};
+		uint32_t generation{}; // incremented whenever the slot gets a new connection or is released
+
+		/** @brief releases all queued data and frees the slot, the socket has to be closed already */
+		void release() {
+			if (rx_chain)
+				pbuf_free(rx_chain);
+			*this = {.generation = generation + 1};
+		}
 	};
-	using connections = static_vector<connection, 8>;
+	using connections = std::array<connection, 8>;
 
 	struct tcp_pcb* server_socket{};
 	connections conns{};
+	uint32_t idle_timeout_ms{60'000};
+	int next_client{}; // round robin start for the next read
+	// request currently processed by the modbus actor, slot and generation are checked on write as the connection might be gone
+	// (a pcb pointer is not enough, lwip reuses the memory of a closed pcb for the next connection)
 	int cur_client{-1};
+	uint32_t cur_generation{};
+	uint16_t cur_transaction{};
+	static_vector<uint8_t, MAX_FRAME_SIZE> frame{};
 	TaskHandle_t data_retrieve_wait{};
 
 	void init() {
@@ -61,59 +96,106 @@ struct tcp_io {
 		LogInfo("Modbus tcp server started");
 	}
 	void deinit() {
-		for (connection &c: conns)
+		for (connection &c: conns) {
 			close_socket(c.client_socket);
-		conns.clear();
+			c.release();
+		}
 		close_socket(server_socket);
 	}
+	/** @brief returns the next complete request frame of any client, waits at most max_timeout if none is queued */
 	std::span<uint8_t> read_bytes(std::chrono::milliseconds max_timeout) {
-		for (int i: range(conns.size())) {
-			if (conns[i].buffer.size()) {
-				std::cout << "got bytes\n";
-				std::span<uint8_t> data = conns[i].buffer.span();
-				conns[i].buffer.clear();
-				cur_client = i;
-				return data;
-			}
-		}
+		lwip_lock();
+		data_retrieve_wait = xTaskGetCurrentTaskHandle(); // set before checking to not miss data arriving in between
+		bool got_frame = _pop_frame();
+		if (got_frame)
+			data_retrieve_wait = {};
+		lwip_unlock();
+		if (got_frame)
+			return frame.span();
 
-		data_retrieve_wait = xTaskGetCurrentTaskHandle();
 		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(max_timeout.count()));
 
-		for (int i: range(conns.size())) {
-			if (conns[i].buffer.size()) {
-				std::cout << "got bytes\n";
-				std::span<uint8_t> data = conns[i].buffer.span();
-				conns[i].buffer.clear();
-				cur_client = i;
-				return data;
-			}
-		}
+		lwip_lock();
+		data_retrieve_wait = {};
+		got_frame = _pop_frame();
+		lwip_unlock();
+		if (got_frame)
+			return frame.span();
 		return {};
 	}
 	void write_bytes(std::span<uint8_t> data) {
-		std::cout << "write bytes\n" << std::endl;
-		if (cur_client == -1)
-			LogError("Missing previous read, no idae where to send to");
-		if (ERR_OK != tcp_write(conns[cur_client].client_socket, data.data(), data.size(), 0))
+		lwip_lock();
+		if (cur_client < 0) {
+			LogError("Missing previous read, no idea where to send to");
+		} else if (data.size() < MBAP_HEADER_SIZE || _transaction_id(data.data()) != cur_transaction) {
+			LogError("Response does not match the pending transaction {}", cur_transaction);
+		} else if (connection &c = conns[cur_client]; c.generation != cur_generation || !c.client_socket) {
+			LogWarning("Client of transaction {} disconnected, dropping response", cur_transaction);
+		} else if (ERR_OK != tcp_write(c.client_socket, data.data(), data.size(), TCP_WRITE_FLAG_COPY)) {
 			LogError("Failed to write tcp data");
+		} else {
+			tcp_output(c.client_socket); // do not wait for the next tcp timer with pipelined requests
+			c.last_activity_ms = now_ms();
+		}
 		cur_client = -1;
+		lwip_unlock();
 	}
 	ls::result get_status() const {
 		if (!server_socket)
 			return "Bad server socket";
 		return ls::OK;
 	}
+
+	static uint32_t now_ms() { return time_us_64() / 1000; }
+
+	/*INTERNAL*/ static uint16_t _transaction_id(const uint8_t *mbap) { return uint16_t(mbap[0] << 8) | mbap[1]; }
+	/*INTERNAL*/ static int _frame_size(const uint8_t *mbap) { return MBAP_HEADER_SIZE + (uint16_t(mbap[4] << 8) | mbap[5]); }
+	/** @brief moves the first complete frame of the next client (round robin) into frame, has to be called with the lwip lock held */
+	/*INTERNAL*/ bool _pop_frame() {
+		for (int i: range(conns.size())) {
+			int c_idx = (next_client + i) % int(conns.size());
+			connection &c = conns[c_idx];
+			if (!c.rx_chain || c.rx_chain->tot_len < MBAP_HEADER_SIZE)
+				continue;
+			std::array<uint8_t, MBAP_HEADER_SIZE> mbap;
+			pbuf_copy_partial(c.rx_chain, mbap.data(), mbap.size(), 0);
+			int size = _frame_size(mbap.data());
+			// the length counts unit id and function code, anything shorter is no modbus request
+			if (size > MAX_FRAME_SIZE || size < MBAP_HEADER_SIZE + 2 || mbap[2] != 0 || mbap[3] != 0) {
+				LogError("Invalid mbap header, dropping client data");
+				_consume(c, c.rx_chain->tot_len);
+				continue;
+			}
+			if (c.rx_chain->tot_len < size)
+				continue;
+			// copies segment wise, the frame may be split over several pbufs
+			frame.cur_size = pbuf_copy_partial(c.rx_chain, frame.begin(), size, 0);
+			_consume(c, size);
+			cur_client = c_idx;
+			cur_generation = c.generation;
+			cur_transaction = _transaction_id(frame.begin());
+			next_client = c_idx + 1;
+			return true;
+		}
+		return false;
+	}
+	/** @brief releases the first size bytes of the rx chain and reopens the receive window by that amount */
+	/*INTERNAL*/ static void _consume(connection &c, int size) {
+		c.rx_chain = pbuf_free_header(c.rx_chain, size);
+		if (c.client_socket)
+			tcp_recved(c.client_socket, size);
+	}
 };
 
 namespace g {
-inline mutex& sunspec_mutex() {
-	static mutex m{};
-	return m;
+/** @brief newest meter values, published by the meter task and taken over by the sunspec server task */
+inline double_buffer<tracked_registers<eastron_sunspec_mapping>>& sunspec_values() {
+	static double_buffer<tracked_registers<eastron_sunspec_mapping>> values{};
+	return values;
 }
+/** @note only to be accessed by the sunspec server task, all other tasks use sunspec_values() */
 inline ls::modbus_actor<sunspec_layout, tcp_io>& sunspec_modbus() {
-	static ls::modbus_actor<sunspec_layout, tcp_io> sunspec{1, []{ std::cout << "server locking\n"; g::sunspec_mutex().lock(); }, []{ std::cout << "server locking\n"; g::sunspec_mutex().unlock(); } };
+	static ls::modbus_actor<sunspec_layout, tcp_io> sunspec{1};
 	return sunspec;
 }
 }
-
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <string_view>
+
+enum struct http_method: uint8_t {
+	GET,
+	POST,
+	PUT,
+	DELETE,
+	UNKNOWN,
+};
+
+constexpr http_method parse_http_method(std::string_view method) {
+	switch (method.size()) {
+	case 3: return method == "GET" ? http_method::GET: method == "PUT" ? http_method::PUT: http_method::UNKNOWN;
+	case 4: return method == "POST" ? http_method::POST: http_method::UNKNOWN;
+	case 6: return method == "DELETE" ? http_method::DELETE: http_method::UNKNOWN;
+	default: return http_method::UNKNOWN;
+	}
+}
+
+struct EndpointFlags{
+	bool path_match: 1 {true}; // path for endpoint has to match, not only
+};
+
+struct route {
+	http_method method;
+	std::string_view path;
+	EndpointFlags flags{};
+};
+
+/**
+ * @brief Router for a constexpr route table, the lookup structure is built at compile time.
+ * Routes with exact path match are found via a perfect hash over method and path (one hash pass
+ * over the path and a single compare, independent of the amount of routes). Only prefix routes
+ * (path_match = false) are checked one after the other, after the exact routes.
+ * @usage
+ * inline constexpr std::array routes{
+ * 	route{http_method::GET, "/index.html"},
+ * 	route{http_method::GET, "/files/", {.path_match = false}},
+ * };
+ * int i = route_table<routes>::find(http_method::GET, "/index.html"); // 0, -1 if no route matches
+ */
+template<const auto &routes>
+struct route_table {
+	static constexpr int SIZE = routes.size();
+	static_assert(SIZE < 128, "Route indices are stored as int8_t");
+	static constexpr uint32_t SLOTS = std::bit_ceil(uint32_t(4 * SIZE + 1)); // sparse table, a seed without collisions is found quickly
+
+	static constexpr uint32_t hash(http_method method, std::string_view path, uint32_t seed) {
+		uint32_t h = (seed ^ uint32_t(method)) * 16777619u; // fnv-1a
+		for (char c: path)
+			h = (h ^ uint8_t(c)) * 16777619u;
+		return (h ^ (h >> 16)) & (SLOTS - 1);
+	}
+	static consteval uint32_t find_seed() {
+		for (int i = 0; i < SIZE; ++i)
+			for (int j = 0; j < i; ++j)
+				if (routes[i].flags.path_match && routes[j].flags.path_match &&
+				    routes[i].method == routes[j].method && routes[i].path == routes[j].path)
+					throw "Duplicate route";
+		for (uint32_t seed = 2166136261u; seed < 2166136261u + 100'000; ++seed) {
+			std::array<bool, SLOTS> used{};
+			bool collision{};
+			for (int i = 0; i < SIZE && !collision; ++i) {
+				if (!routes[i].flags.path_match)
+					continue;
+				uint32_t slot = hash(routes[i].method, routes[i].path, seed);
+				collision = used[slot];
+				used[slot] = true;
+			}
+			if (!collision)
+				return seed;
+		}
+		throw "No perfect hash seed found for the routes";
+	}
+	static constexpr uint32_t SEED = find_seed();
+
+	static consteval std::array<int8_t, SLOTS> build_slots() {
+		std::array<int8_t, SLOTS> slots{};
+		slots.fill(-1);
+		for (int i = 0; i < SIZE; ++i)
+			if (routes[i].flags.path_match)
+				slots[hash(routes[i].method, routes[i].path, SEED)] = i;
+		return slots;
+	}
+	static constexpr std::array<int8_t, SLOTS> slots = build_slots();
+
+	static consteval int prefix_count() {
+		int count{};
+		for (int i = 0; i < SIZE; ++i)
+			count += !routes[i].flags.path_match;
+		return count;
+	}
+	static consteval std::array<int8_t, prefix_count()> build_prefix_routes() {
+		std::array<int8_t, prefix_count()> prefix{};
+		for (int i = 0, p = 0; i < SIZE; ++i)
+			if (!routes[i].flags.path_match)
+				prefix[p++] = i;
+		return prefix;
+	}
+	static constexpr std::array<int8_t, prefix_count()> prefix_routes = build_prefix_routes();
+
+	/** @return index of the matching route in routes, -1 if none matches */
+	static constexpr int find(http_method method, std::string_view path) {
+		int i = slots[hash(method, path, SEED)];
+		if (i >= 0 && routes[i].method == method && routes[i].path == path)
+			return i;
+		for (int p: prefix_routes)
+			if (routes[p].method == method && path.starts_with(routes[p].path))
+				return p;
+		return -1;
+	}
+};
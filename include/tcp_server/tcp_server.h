@@ -1,34 +1,39 @@
 #pragma once
 
-#include <functional>
+#include <algorithm>
 #include <atomic>
+#include <charconv>
+#include <span>
 
 #include "string_util.h"
 #include "static_types.h"
+#include "route_table.h"
+#include "websocket.h"
 
 #include "lwip/pbuf.h"
 #include "lwip/tcp.h"
+#include "pico/time.h"
 #include "log_storage.h"
+#include "lwip_init.h"
 
 // ------------------------------------------------------------------------------
 // struct declarations
 // ------------------------------------------------------------------------------
 
-#define template_args <int get_size, int post_size, int put_size, int delete_size, int max_path_length, int max_headers, int buf_size, int message_buffers>
-#define template_args_pure <get_size, post_size, put_size, delete_size, max_path_length, max_headers, buf_size, message_buffers>
+#define template_args <const auto &routes, int max_headers, int buf_size, int message_buffers>
+#define template_args_pure <routes, max_headers, buf_size, message_buffers>
 
 constexpr std::string_view HTTP_VERSION{"HTTP/1.1"};
 
+constexpr std::string_view STATUS_SWITCHING_PROTOCOLS{"101 Switching Protocols"};
 constexpr std::string_view STATUS_OK{"200 OK"};
+constexpr std::string_view STATUS_NOT_MODIFIED{"304 Not Modified"};
 constexpr std::string_view STATUS_BAD_REQUEST{"400 Bad Request"};
 constexpr std::string_view STATUS_UNAUTHORIZED{"401 Unauthorized"};
 constexpr std::string_view STATUS_FORBIDDEN{"403 Forbidden"};
 constexpr std::string_view STATUS_NOT_FOUND{"404 Not Found"};
 constexpr std::string_view STATUS_INTERNAL_SERVER_ERROR{"500 Internal Server Error"};
-
-struct EndpointFlags{
-	bool path_match: 1 {true}; // path for endpoint has to match, not only 
-};
+constexpr std::string_view STATUS_SERVICE_UNAVAILABLE{"503 Service Unavailable"};
 
 struct header {
 	std::string_view key;
@@ -48,9 +53,23 @@ struct headers {
 };
 
 /** @brief Tcp server that serves text data according to path specification.
+  * The paths are given as constexpr route table (see route_table.h), endpoints[i] serves routes[i]
+  * (bind_endpoints() builds endpoints from method, path and callback triples and checks them at compile time).
   * The returned content can be freely configured via callbacks via callbacks 
-  * @note The tcp server instantly discards any connection after the response was sent.*/
-template<int get_size, int post_size, int put_size = 0, int delete_size = 0, int max_path_length = 256, int max_headers = 32, int buf_size = 4096, int message_buffers = 4>
+  * @note Connections are kept alive (http/1.1 default) and closed after idle_timeout_s without requests,
+  * or directly after the response if the client asked for `Connection: close`.
+  * Requests are parsed incrementally over several receives and several pipelined requests
+  * in one receive buffer are answered in order. Data that does not fit into the receive buffer stays in the lwip
+  * pbufs and the receive window is only reopened once it is copied (backpressure), requests which can never fit
+  * are answered with 413 (body) or 431 (header section).
+  * Responses are written as far as the tcp send buffer allows and continued from the sent callback,
+  * static bodies (res_write_static_body) are handed to lwip by reference without copying them.
+  * Endpoints can turn their connection into a text/event-stream subscriber (res_start_event_stream),
+  * each event given to publish_event() is then written once into the send buffers of all subscribers.
+  * Connections upgraded to a websocket (res_upgrade_websocket) subscribe to topics by sending text messages
+  * "+<topic>" or "-<topic>" with a name from websocket_topics, publish_websocket() sends "<topic> <message>"
+  * to all subscribers of the topic. Pings are answered and idle websockets are pinged before they are closed.*/
+template<const auto &routes, int max_headers = 32, int buf_size = 4096, int message_buffers = 4>
 struct tcp_server {
 	/**
 	 * @brief Struct with a full http frame for both sending and recieving.
@@ -61,23 +80,47 @@ struct tcp_server {
 		std::atomic<bool> used{};
 		static_string<buf_size> buffer{};
 		std::string_view method{}; // set to the method for a request http frame, else is empty and cannot be written
+		http_method method_id{}; // parsed method of a request http frame
 		std::string_view path{}; // set to the path of a request http frame, else is empty and can not be written
+		std::string_view query{}; // part of the request target after '?', not part of the path
 		std::string_view http_version{}; // version of the http protocol, normally HTTP/1.1
 		std::string_view status{}; // status code followed by a space and a possibly empty reason string
 		headers<max_headers> headers_view{}; // actually only contains std::string views to underlying buffer
 		std::string_view body{};
+		std::string_view static_body{}; // response: sent by reference after the buffer, has to outlive the connection (eg. flash)
 
 		struct tcp_pcb *tpcb{};
-		bool on_stream_out{};
+		bool keep_alive{}; // response: connection stays open after the response, written as header in res_set_status_line
+		bool event_stream{}; // response: connection stays open as event stream subscriber after the response head
+		bool websocket{}; // response: connection is upgraded to a websocket after the response head
+
+		// request parser state, the parser resumes at parsed_size when more data was appended to the buffer
+		enum struct parse_state { request_line, headers, body, complete };
+		parse_state state{};
+		int parsed_size{};
+		int content_length{};
 
 		tcp_server *parent_server{};
 
 		// ------------------------------------------------------
 		// request functions
 		// ------------------------------------------------------
-		/** @brief update the headers_view and body view from this message_buffer 
+		/** @brief continues parsing the request at the start of the buffer and updates the structured views
+		 * @return true if the request is complete (request line, headers and Content-Length body),
+		 * false if more data has to be appended to the buffer
 		 * @note used for reading/parsing a package*/
-		void req_update_structured_views();
+		bool req_parse();
+		/** @brief removes the complete request from the front of the buffer and resets the parser,
+		 * further pipelined data is moved to the buffer start */
+		void req_consume();
+		/** @brief whether the connection should be kept open after answering this request */
+		bool req_keep_alive() const;
+		/** @brief whether the incomplete request can never fit into the buffer (1 byte is reserved to null terminate the body) */
+		bool req_too_large() const {
+			if (state == parse_state::body)
+				return parsed_size + content_length > int(buffer.storage.size()) - 1;
+			return buffer.size() >= int(buffer.storage.size()) - 1;
+		}
 
 		// ------------------------------------------------------
 		// response functions
@@ -93,40 +136,129 @@ struct tcp_server {
 		  * @logs Warning if add_header is called when body is not empty*/
 		header res_add_header(std::string_view key, std::string_view value);
 		/** @brief writes the string_view the end of the backing buffer directly after the header section
-		  * and sets the internal body variable to exactly this string */
-		void res_write_body(std::string_view body = {});
-		void clear() { used = {}; buffer.clear(); method = {}; path = {}; http_version = {}; status = {}; headers_view.headers.clear(); body = {}; tpcb = {}; on_stream_out = {}; }
+		  * and sets the internal body variable to exactly this string
+		  * @note if the body does not fit into the buffer the response is replaced by a bodyless 500,
+		  * as its Content-Length would not match anymore. Larger bodies have to be static
+		  * @return false if the response was replaced */
+		bool res_write_body(std::string_view body = {});
+		/** @brief ends the header section, the body is not copied but sent by reference after the buffer content
+		  * @note for constant data only, as the body is referenced until the client acknowledged it */
+		void res_write_static_body(std::string_view body) { if (res_write_body()) static_body = body; }
+		/** @brief writes the head of a text/event-stream response, the connection then gets all events from publish_event()
+		  * @return false if max_event_subscribers is reached, a 503 response is written instead */
+		bool res_start_event_stream();
+		/** @brief writes the 101 response upgrading the connection of the request to a websocket
+		  * @return false if the request is no valid upgrade request (400) or max_websockets is reached (503) */
+		bool res_upgrade_websocket(const message_buffer &request);
+		void clear() { used = {}; buffer.clear(); method = {}; method_id = {}; path = {}; query = {}; http_version = {}; status = {}; headers_view.headers.clear(); body = {}; static_body = {}; tpcb = {}; keep_alive = {}; event_stream = {}; websocket = {}; state = {}; parsed_size = {}; content_length = {}; }
 	};
-	using endpoint_callback = std::function<void(const message_buffer &request, message_buffer& response)>;
-	struct endpoint {
-		EndpointFlags flags;
-		std::array<char, 256> path;
+	using endpoint_callback = void(*)(const message_buffer &request, message_buffer& response); // plain function pointer, no allocation and no type erasure
+	using router = route_table<routes>;
+	struct endpoint_binding {
+		http_method method;
+		std::string_view path;
 		endpoint_callback callback;
 	};
+	/** @brief places each callback at the index of its route, the order of the bindings does not matter
+	  * @note fails to compile if a binding has no route or a route has no or several bindings */
+	template<size_t N>
+	static consteval std::array<endpoint_callback, routes.size()> bind_endpoints(const endpoint_binding (&bindings)[N]) {
+		std::array<endpoint_callback, routes.size()> endpoints{};
+		for (const endpoint_binding &binding: bindings) {
+			int i = 0;
+			for (; i < int(routes.size()) && (routes[i].method != binding.method || routes[i].path != binding.path); ++i);
+			if (i == int(routes.size()))
+				throw "Endpoint binding without route";
+			if (endpoints[i])
+				throw "Route bound twice";
+			if (!binding.callback)
+				throw "Endpoint binding without callback";
+			endpoints[i] = binding.callback;
+		}
+		for (endpoint_callback endpoint: endpoints)
+			if (!endpoint)
+				throw "Route without endpoint binding";
+		return endpoints;
+	}
 
 	int port{80};
 	endpoint_callback default_endpoint_cb{};
-	std::array<endpoint, get_size> get_endpoints{};
-	std::array<endpoint, post_size> post_endpoints{};
-	std::array<endpoint, put_size> put_endpoints{};
-	std::array<endpoint, delete_size> delete_endpoints{};
+	std::array<endpoint_callback, routes.size()> endpoints{}; // endpoints[i] is called for requests matching routes[i], see bind_endpoints()
 	int poll_time_s{5};
+	int idle_timeout_s{30}; // kept alive connections without a request for this long are closed
+	int max_event_subscribers{2}; // further event stream requests are answered with 503
+	int max_websockets{2}; // further websocket upgrades are answered with 503
+	std::span<const std::string_view> websocket_topics{}; // topic names for the websocket subscriptions, at max 32
+	std::atomic<uint32_t> new_websocket_subscriptions{}; // bit per topic which got a subscriber since the last take_new_websocket_subscriptions()
 
 	~tcp_server() { if(!closed) LogError("Tcp server not closed before destruction!"); };
 	err_t start();
 	err_t stop();
+	/** @brief amount of connected event stream subscribers, allows to skip formatting events nobody gets */
+	int event_subscribers() const;
+	/** @brief writes the event (already formatted, eg. "data: ...\n\n") to all event stream subscribers
+	  * @note to be called from a task, not from within lwip callbacks as the lwip lock is taken.
+	  * Subscribers which have no room left in their tcp send buffer skip the event */
+	void publish_event(std::string_view event);
+	/** @brief amount of websockets subscribed to the topic, -1 for all websockets */
+	int websocket_subscribers(int topic = -1) const;
+	/** @brief topics (as bits) which got new subscribers since the last call, allows to publish the current state to them */
+	uint32_t take_new_websocket_subscriptions() { return new_websocket_subscriptions.exchange(0); }
+	/** @brief sends "<topic name> <message>" as text message to all websockets subscribed to the topic
+	  * @note same as publish_event(): to be called from a task, subscribers without room in their send buffer skip the message */
+	void publish_websocket(int topic, std::string_view message);
 	
 	struct tcp_pcb *server_pcb{};
 	bool closed{};
+	/** @brief per client data, given to lwip as callback arg to identify the client */
+	struct client_state {
+		tcp_server *server{};
+		uint32_t last_activity_ms{};
+		// response which is currently sent, further requests of the client are only processed once it is written
+		message_buffer *response{};
+		std::string_view pending_head{}; // not yet written part of the response buffer
+		std::string_view pending_body{}; // not yet written part of the static body
+		bool close_after_send{};
+		bool event_stream{}; // gets the events from publish_event() once the response head is written
+		bool websocket{}; // the recieve buffer holds websocket frames instead of http requests
+		uint32_t websocket_topics{}; // bit per subscribed topic
+		bool websocket_ping_sent{};
+		// received data which did not fit into the recieve buffer yet, it is acknowledged to lwip (tcp_recved)
+		// only once copied, so the receive window closes while the client waits for its responses
+		struct pbuf *rx_pending{};
+
+		/** @brief a response is written, further requests wait until it is done */
+		bool responding() const { return response || pending_head.size() || pending_body.size(); }
+		void reset_response() { if (response) response->clear(); response = {}; pending_head = {}; pending_body = {}; close_after_send = {}; }
+		void release() { reset_response(); event_stream = {}; websocket = {}; websocket_topics = {}; websocket_ping_sent = {}; if (rx_pending) pbuf_free(rx_pending); rx_pending = {}; }
+	};
 	std::array<std::atomic<struct tcp_pcb*>, message_buffers> client_pcbs{}; // each client has 1 send and recieve buffer for itself
+	std::array<client_state, message_buffers> clients{};
 	std::array<message_buffer, message_buffers> send_buffers{};
-	std::array<message_buffer, message_buffers> recieve_buffers{};
+	std::array<message_buffer, message_buffers> recieve_buffers{}; // recieve_buffers[i] belongs to client_pcbs[i]
 	int sent_len{};
 	int recv_len{};
 	int run_count{};
 
-	void process_request(uint32_t recieve_buffer_idx, struct tcp_pcb *client);
-	err_t send_data(std::string_view data, struct tcp_pcb *client);
+	/** @brief moves the pending received data of the client into its recieve buffer as far as it fits and processes it,
+	  * the rest stays pending until answered requests free up buffer space
+	  * @return ERR_ABRT if the connection was aborted, else ERR_OK */
+	err_t receive(client_state &client, struct tcp_pcb *tpcb);
+	/** @brief processes all complete requests in the recieve buffer of the client, stops while a response is still being written
+	  * @return ERR_ABRT if the connection was aborted, else ERR_OK */
+	err_t process_requests(client_state &client, struct tcp_pcb *tpcb);
+	/** @brief calls the endpoint for the parsed request and starts sending the response
+	  * @return ERR_OK if the connection stays open, else the error of closing the connection */
+	err_t process_request(const message_buffer &request, client_state &client, struct tcp_pcb *tpcb);
+	/** @brief writes as much of the pending response as the tcp send buffer takes, called again from the sent callback
+	  * @return ERR_OK if the connection stays open, else the error of closing the connection */
+	err_t continue_response(client_state &client, struct tcp_pcb *tpcb);
+	/** @brief handles all complete websocket frames in the recieve buffer of the client
+	  * @return ERR_ABRT if the connection was aborted, else ERR_OK */
+	err_t process_websocket_frames(client_state &client, struct tcp_pcb *tpcb);
+	/** @brief writes a websocket frame with the payload prefix + payload, the caller has to hold the lwip lock
+	  * @return ERR_MEM if the send buffer has no room for the frame */
+	err_t send_websocket_frame(struct tcp_pcb *tpcb, websocket_opcode opcode, std::string_view prefix, std::string_view payload = {});
 };
 
 // ------------------------------------------------------------------------------
@@ -135,6 +267,8 @@ struct tcp_server {
 
 namespace tcp_server_internal {
 
+static uint32_t now_ms() { return time_us_64() / 1000; }
+
 /** @brief Contains all implementations regarding tcp server connections */
 constexpr static err_t clear_client_pcb(std::atomic<struct tcp_pcb*> &pcb) {
 	err_t err{ERR_OK};
@@ -163,100 +297,126 @@ constexpr static err_t tcp_server_result(void *arg, int status, struct tcp_pcb *
 	}
 	LogWarning("Server failed {}, deinitializing {}", status, client ? "one client": "no client");
 	err_t err = ERR_OK;
-	for (auto &pcb: server.client_pcbs) {
+	for (uint32_t i = 0; i < server.client_pcbs.size(); ++i) {
+		auto &pcb = server.client_pcbs[i];
 		if (pcb == nullptr || (client && pcb != client))
 			continue;
 		err = clear_client_pcb(pcb);
+		server.recieve_buffers[i].clear();
+		server.clients[i].release();
 	}
 	return err;
 }
 
 template template_args
 constexpr static err_t tcp_server_sent(void *arg, struct tcp_pcb *tpcb, u16_t len) {
-	return ERR_OK;
+	if (!arg)
+		return ERR_OK;
+	auto &client = *reinterpret_cast<tcp_server template_args_pure::client_state*>(arg);
+	if (!client.responding())
+		return ERR_OK;
+	client.last_activity_ms = now_ms();
+	err_t err = client.server->continue_response(client, tpcb);
+	if (err != ERR_OK || client.responding())
+		return err == ERR_ABRT ? ERR_ABRT: ERR_OK;
+	// response done, answer the requests which came in meanwhile
+	return client.server->receive(client, tpcb);
 }
 
 
 template template_args
 constexpr static err_t tcp_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
-	if (!p || !arg) {
-		LogError("tcp_server_recv() failed");
-		return tcp_server_result template_args_pure(arg, -1, tpcb);
-	}
-	tcp_server template_args_pure& server = reinterpret_cast<tcp_server template_args_pure&>(*(char*)arg);
-	if (p->tot_len > buf_size)
-		LogError("Message too big, could not recieve");
-	else if (p->tot_len > 0) {
-		// Receive the buffer
-		int recieve_buffer{-1};
-		bool recieve_success{};
-		for (auto &buffer: server.recieve_buffers) {
-			++recieve_buffer;
-			if (buffer.used.exchange(true))
-				continue;
-			buffer.buffer.set_size(pbuf_copy_partial(p, buffer.buffer.data(), p->tot_len, 0));
-			server.process_request(recieve_buffer, tpcb);
-			recieve_success = true;
-			break;
-		}
-		if (!recieve_success)
-			LogError("Could not recieve message, no free recieve buffer");
+	if (!arg) {
+		LogError("tcp_server_recv() failed, no client");
+		if (p)
+			pbuf_free(p);
+		tcp_abort(tpcb);
+		return ERR_ABRT;
 	}
-	pbuf_free(p);
-	return ERR_OK;
+	auto &client = *reinterpret_cast<tcp_server template_args_pure::client_state*>(arg);
+	tcp_server template_args_pure& server = *client.server;
+	if (!p) // remote closed the connection
+		return tcp_server_result template_args_pure(&server, -1, tpcb);
+	client.last_activity_ms = now_ms();
+	// the pbufs are kept until their data fits into the recieve buffer, requests arriving while a
+	// response is written (pipelining, websocket frames after the 101) wait there instead of being dropped
+	if (client.rx_pending)
+		pbuf_cat(client.rx_pending, p);
+	else
+		client.rx_pending = p;
+	err = server.receive(client, tpcb);
+	return err == ERR_ABRT ? ERR_ABRT: ERR_OK;
 }
 
 template template_args
 constexpr static err_t tcp_server_poll(void *arg, struct tcp_pcb *tpcb) {
-	// remove connections that are not anymore valid
-	LogInfo("tcp_server_poll_fn");
-	return tcp_server_result template_args_pure(arg, -1, tpcb); // on no response remove the client to free up space
+	if (!arg) {
+		tcp_abort(tpcb);
+		return ERR_ABRT;
+	}
+	auto &client = *reinterpret_cast<tcp_server template_args_pure::client_state*>(arg);
+	uint32_t idle_ms = now_ms() - client.last_activity_ms;
+	// websockets are pinged after half the idle timeout, the pong of the browser counts as activity
+	if (client.websocket && !client.websocket_ping_sent && idle_ms >= uint32_t(client.server->idle_timeout_s) * 500) {
+		client.websocket_ping_sent = true;
+		client.server->send_websocket_frame(tpcb, websocket_opcode::PING, {});
+		return ERR_OK;
+	}
+	// event stream subscribers are active with every published event
+	if (idle_ms < uint32_t(client.server->idle_timeout_s) * 1000)
+		return ERR_OK;
+	LogInfo("Closing idle client");
+	return tcp_server_result template_args_pure(client.server, -1, tpcb);
 }
 
 template template_args
 constexpr static void tcp_server_err(void *arg, err_t err) {
 	LogError("tcp_server_err {}", err);
-	if (err != ERR_ABRT) {
-		LogError("tcp_client_err_fn {}", err);
-		tcp_server_result template_args_pure(arg, err, nullptr);
-	}
+	if (!arg)
+		return;
+	// the pcb was already freed by lwip, only the client slot is released
+	auto &client = *reinterpret_cast<tcp_server template_args_pure::client_state*>(arg);
+	tcp_server template_args_pure& server = *client.server;
+	int i = &client - server.clients.data();
+	server.client_pcbs[i] = nullptr;
+	server.recieve_buffers[i].clear();
+	client.release();
 }
 
 template template_args
 constexpr static err_t tcp_server_accept (void *arg, struct tcp_pcb *client_pcb, err_t err) {
 	if (err != ERR_OK || client_pcb == NULL || arg == NULL) {
 		LogError("Failure in accept");
-		tcp_server_result template_args_pure(arg, err, nullptr);
 		return ERR_VAL;
 	}
 
 	tcp_server template_args_pure& server = reinterpret_cast<tcp_server template_args_pure&>(*(char*)arg);
 	
 	// search for empty slot and assing it a new value
-	bool found_empty_spot{};
 	int i{};
 	for (auto &pcb: server.client_pcbs) {
-		++i;
 		struct tcp_pcb *null{}; // should be nullptr
-		found_empty_spot |= pcb.compare_exchange_strong(null, client_pcb);
-		if (found_empty_spot)
+		if (pcb.compare_exchange_strong(null, client_pcb))
 			break;
+		++i;
 	}
 
-	if (!found_empty_spot) {
-		LogError("All clients already connected, refusing");
-		err = tcp_close(client_pcb);
-		if (err != ERR_OK) {
-			LogError("close failed calling abort: {}", err);
-			tcp_abort(client_pcb);
-			err = ERR_ABRT;
-		}
-		return err;
+	if (i == message_buffers) {
+		// kept alive connections would block new clients, the least recently active one has to go
+		uint32_t now = now_ms();
+		i = 0;
+		for (int j = 1; j < message_buffers; ++j)
+			if (now - server.clients[j].last_activity_ms > now - server.clients[i].last_activity_ms)
+				i = j;
+		LogWarning("All clients already connected, closing least recently active client {}", i);
+		tcp_server_result template_args_pure(arg, -1, server.client_pcbs[i]);
+		server.client_pcbs[i] = client_pcb;
 	}
 
 	LogInfo("Client connected on id {}, setting up callbacks", i);
-	
-	tcp_arg(client_pcb, arg);
+
+	server.clients[i] = {.server = &server, .last_activity_ms = now_ms()};
+	tcp_arg(client_pcb, &server.clients[i]);
 	tcp_sent(client_pcb, tcp_server_sent template_args_pure);
 	tcp_recv(client_pcb, tcp_server_recv template_args_pure);
 	tcp_poll(client_pcb, tcp_server_poll template_args_pure, server.poll_time_s * 2);
@@ -270,40 +430,87 @@ constexpr static err_t tcp_server_accept (void *arg, struct tcp_pcb *client_pcb,
 } // namespace tcp_server::internal
 
 template template_args
-void tcp_server template_args_pure::message_buffer::req_update_structured_views() {
-	// request line
+bool tcp_server template_args_pure::message_buffer::req_parse() {
 	std::string_view buffer_view{buffer.sv()};
-	method = extract_word(buffer_view);
-	path = extract_word(buffer_view);
-	http_version = extract_word(buffer_view);
-	if (!extract_newline(buffer_view))
-		LogWarning("req_update_structured_views() did not find newline sequence after the request line");
-	// headers
-	for (std::string_view key = extract_word(buffer_view), value = extract_until_newline(buffer_view);
-		!key.empty(); key = extract_word(buffer_view), value = extract_until_newline(buffer_view)) {
-
-		key.remove_suffix(key.empty() ? 0: 1);
-		if (!headers_view.headers.push(header{key, value}))
-			LogWarning("req_update_structured_views() Failed to add the following header:");
-
-		// last header does not necessarily need a newline after it
-		if (!extract_newline(buffer_view))
-			LogInfo("req_update_structured_views() did not find newline sequence after header");
-	}
-	// body (is simply the rest without the first newline, can be null so only logging missing newline on info level)
-	if (!extract_newline(buffer_view))
-		LogInfo("req_update_structured_views() did not find a newline for body info");
-	body = buffer_view;
-	buffer.append('\0');
+	while (state != parse_state::complete) {
+		if (state == parse_state::body) {
+			if (buffer_view.size() - parsed_size < size_t(content_length))
+				return false;
+			body = buffer_view.substr(parsed_size, content_length);
+			parsed_size += content_length;
+			state = parse_state::complete;
+			break;
+		}
+
+		size_t line_end = buffer_view.find("\r\n", parsed_size);
+		if (line_end == std::string_view::npos)
+			return false;
+		std::string_view line = buffer_view.substr(parsed_size, line_end - parsed_size);
+		parsed_size = line_end + 2;
+
+		if (state == parse_state::request_line) {
+			if (line.empty()) // tolerate empty lines between pipelined requests
+				continue;
+			method = extract_word(line);
+			method_id = parse_http_method(method);
+			path = extract_word(line);
+			size_t query_start = std::min(path.find('?'), path.size());
+			query = path.substr(std::min(query_start + 1, path.size()));
+			path = path.substr(0, query_start);
+			http_version = extract_word(line);
+			state = parse_state::headers;
+		} else if (line.empty()) { // end of the header section
+			std::string_view length_header = headers_view.get_header("Content-Length");
+			content_length = 0;
+			std::from_chars(length_header.data(), length_header.data() + length_header.size(), content_length);
+			if (content_length < 0) {
+				LogWarning("req_parse() invalid Content-Length, ignoring body");
+				content_length = 0;
+			}
+			state = parse_state::body;
+		} else {
+			size_t colon = line.find(':');
+			if (colon == std::string_view::npos) {
+				LogWarning("req_parse() ignoring malformed header line");
+				continue;
+			}
+			std::string_view value = line.substr(colon + 1);
+			value.remove_prefix(std::min(value.find_first_not_of(" \t"), value.size()));
+			if (!headers_view.headers.push(header{line.substr(0, colon), value}))
+				LogWarning("req_parse() Failed to add the following header:");
+		}
+	}
+	return true;
+}
+
+template template_args
+void tcp_server template_args_pure::message_buffer::req_consume() {
+	int rest = buffer.size() - parsed_size;
+	std::copy_n(buffer.data() + parsed_size, rest, buffer.data());
+	buffer.set_size(rest);
+	method = {};
+	method_id = {};
+	path = {};
+	query = {};
+	http_version = {};
+	headers_view.headers.clear();
+	body = {};
+	state = {};
+	parsed_size = {};
+	content_length = {};
+}
+
+template template_args
+bool tcp_server template_args_pure::message_buffer::req_keep_alive() const {
+	std::string_view connection = headers_view.get_header("Connection");
+	if (http_version == HTTP_VERSION)
+		return connection != "close";
+	return connection == "keep-alive";
 }
 
 template template_args
 void tcp_server template_args_pure::message_buffer::res_set_status_line(std::string_view http_version, std::string_view status) {
 	// sanity checks
-	if (on_stream_out) {
-		buffer.clear();
-		LogWarning("res_set_status_line() already streaming out");
-	}
 	if (!buffer.empty()) {
 		buffer.clear();
 		LogWarning("res_set_status_line() size != 0, is reset");
@@ -318,26 +525,38 @@ void tcp_server template_args_pure::message_buffer::res_set_status_line(std::str
 	}
 	method = {};
 	path = {};
+	query = {};
 
-	buffer.append_formatted("{} {}\r\n", http_version, status);
+	buffer.append(http_version);
+	buffer.append(' ');
+	buffer.append(status);
+	buffer.append("\r\n");
 	this->http_version = buffer.sv();
 	this->status = buffer.sv();
+	if (websocket) {
+		res_add_header("Connection", "Upgrade");
+		res_add_header("Upgrade", "websocket");
+	} else if (keep_alive) {
+		res_add_header("Connection", "keep-alive");
+		res_add_header("Keep-Alive", static_format<16>("timeout={}", parent_server->idle_timeout_s));
+	} else {
+		res_add_header("Connection", "close");
+	}
 }
 
 template template_args
 header tcp_server template_args_pure::message_buffer::res_add_header(std::string_view key, std::string_view value) {
 	// sanity checks
-	if (on_stream_out) {
-		buffer.clear();
-		LogWarning("res_add_header() already streaming out");
-	}
 	if (!body.empty()) {
 		body = {};
 		LogWarning("res_add_header() body.size() != 0, is reset");
 	}
 
 	int s = buffer.size();
-	buffer.append_formatted("{}: {}\r\n", key, value);
+	buffer.append(key);
+	buffer.append(": ");
+	buffer.append(value);
+	buffer.append("\r\n");
 	if (!this->headers_view.headers.push(header{buffer.sv().substr(s), buffer.sv().substr(s + key.size() + 2)})) {
 		LogWarning("Reached header limit {}", max_headers);
 		return {};
@@ -346,29 +565,77 @@ header tcp_server template_args_pure::message_buffer::res_add_header(std::string
 }
 
 template template_args
-void tcp_server template_args_pure::message_buffer::res_write_body(std::string_view body) {
-	if (this->body.empty() && !on_stream_out)
+bool tcp_server template_args_pure::message_buffer::res_write_body(std::string_view body) {
+	int needed = (this->body.empty() ? 2: 0) + int(body.size());
+	if (needed > int(buffer.storage.size()) - buffer.size()) {
+		LogError("Response body of {} bytes does not fit, answering with 500", body.size());
+		buffer.clear();
+		headers_view.headers.clear();
+		this->body = {};
+		static_body = {};
+		res_set_status_line(HTTP_VERSION, STATUS_INTERNAL_SERVER_ERROR);
+		res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res_add_header("Content-Length", "0");
+		buffer.append("\r\n");
+		this->body = std::string_view{buffer.end(), buffer.end()};
+		return false;
+	}
+	if (this->body.empty())
 		buffer.append("\r\n");
 	const char *s = this->body.empty() ? buffer.end(): this->body.begin();
+	buffer.append(body);
+	this->body = std::string_view{s, buffer.end()};
+	return true;
+}
 
-	for (int i = 0; i < 32 && body.size(); ++i) {
-		int append_size = body.size(); 
-		int f = buffer.storage.size() - 1;
-		int m = f - buffer.size();
-		if (append_size > m) {
-			append_size = m;
-			on_stream_out = true;
-			s = buffer.data();
-		}
-		buffer.append(body.substr(0, append_size));
-		if (buffer.size() == f) {
-			LogInfo("Streaming out a frame of data");
-			parent_server->send_data(buffer.sv(), tpcb);
-			buffer.clear();
-		}
-		body = body.substr(append_size);
+template template_args
+bool tcp_server template_args_pure::message_buffer::res_start_event_stream() {
+	if (parent_server->event_subscribers() >= parent_server->max_event_subscribers) {
+		LogWarning("Maximum of {} event subscribers reached", parent_server->max_event_subscribers);
+		res_set_status_line(HTTP_VERSION, STATUS_SERVICE_UNAVAILABLE);
+		res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res_add_header("Retry-After", "10");
+		res_add_header("Content-Length", "0");
+		res_write_body();
+		return false;
 	}
-	this->body = std::string_view{s, buffer.end()};
+	// the stream has no length and ends with the connection
+	keep_alive = false;
+	event_stream = true;
+	res_set_status_line(HTTP_VERSION, STATUS_OK);
+	res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+	res_add_header("Content-Type", "text/event-stream");
+	res_add_header("Cache-Control", "no-cache");
+	res_write_body();
+	return true;
+}
+
+template template_args
+bool tcp_server template_args_pure::message_buffer::res_upgrade_websocket(const message_buffer &request) {
+	std::string_view key = request.headers_view.get_header("Sec-WebSocket-Key");
+	if (request.headers_view.get_header("Upgrade") != "websocket" || key.empty()) {
+		LogWarning("Invalid websocket upgrade request");
+		res_set_status_line(HTTP_VERSION, STATUS_BAD_REQUEST);
+		res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res_add_header("Content-Length", "0");
+		res_write_body();
+		return false;
+	}
+	if (parent_server->websocket_subscribers() >= parent_server->max_websockets) {
+		LogWarning("Maximum of {} websockets reached", parent_server->max_websockets);
+		res_set_status_line(HTTP_VERSION, STATUS_SERVICE_UNAVAILABLE);
+		res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res_add_header("Retry-After", "10");
+		res_add_header("Content-Length", "0");
+		res_write_body();
+		return false;
+	}
+	websocket = true;
+	res_set_status_line(HTTP_VERSION, STATUS_SWITCHING_PROTOCOLS);
+	res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+	res_add_header("Sec-WebSocket-Accept", websocket_accept_key(key).sv());
+	res_write_body();
+	return true;
 }
 
 template template_args
@@ -407,10 +674,12 @@ err_t tcp_server template_args_pure::start() {
 template template_args
 err_t tcp_server template_args_pure::stop() {
 	err_t err = ERR_OK;
-	for (auto &client_pcb: client_pcbs) {
-		if (client_pcb = nullptr) 
+	for (uint32_t i = 0; i < client_pcbs.size(); ++i) {
+		if (client_pcbs[i] == nullptr) 
 			continue;
-		clear_client_pcb(client_pcb);
+		tcp_server_internal::clear_client_pcb(client_pcbs[i]);
+		recieve_buffers[i].clear();
+		clients[i].release();
 	}
 	if (server_pcb) {
 		tcp_arg(server_pcb, NULL);
@@ -423,77 +692,273 @@ err_t tcp_server template_args_pure::stop() {
 
 
 template template_args
-void tcp_server template_args_pure::process_request(uint32_t recieve_buffer_idx, struct tcp_pcb *client) {
-	if (recieve_buffer_idx >= recieve_buffers.size()) {
-		LogError("Impossible recieve buffer idx");
-		return;
+int tcp_server template_args_pure::event_subscribers() const {
+	int count{};
+	for (uint32_t i = 0; i < clients.size(); ++i)
+		count += client_pcbs[i] != nullptr && clients[i].event_stream;
+	return count;
+}
+
+template template_args
+void tcp_server template_args_pure::publish_event(std::string_view event) {
+	lwip_lock();
+	for (uint32_t i = 0; i < clients.size(); ++i) {
+		struct tcp_pcb *pcb = client_pcbs[i];
+		auto &client = clients[i];
+		// subscribers with a pending response head get the next event
+		if (!pcb || !client.event_stream || client.responding())
+			continue;
+		// only the latest values are of interest, slow subscribers drop events instead of queueing them
+		if (tcp_sndbuf(pcb) < event.size() || tcp_sndqueuelen(pcb) >= TCP_SND_QUEUELEN)
+			continue;
+		err_t err = tcp_write(pcb, event.data(), event.size(), TCP_WRITE_FLAG_COPY);
+		if (err == ERR_OK)
+			err = tcp_output(pcb);
+		if (err != ERR_OK) {
+			LogWarning("Failed to publish event to client {}: {}", i, err);
+			tcp_server_internal::tcp_server_result template_args_pure(this, -1, pcb);
+			continue;
+		}
+		client.last_activity_ms = tcp_server_internal::now_ms();
 	}
-	auto &recieve_buffer = recieve_buffers[recieve_buffer_idx];
+	lwip_unlock();
+}
+
+template template_args
+int tcp_server template_args_pure::websocket_subscribers(int topic) const {
+	int count{};
+	for (uint32_t i = 0; i < clients.size(); ++i)
+		count += client_pcbs[i] != nullptr && clients[i].websocket && (topic < 0 || clients[i].websocket_topics & (1u << topic));
+	return count;
+}
 
+template template_args
+void tcp_server template_args_pure::publish_websocket(int topic, std::string_view message) {
+	static_string<34> prefix{};
+	prefix.append(websocket_topics[topic].substr(0, 32));
+	prefix.append(' ');
+	lwip_lock();
+	for (uint32_t i = 0; i < clients.size(); ++i) {
+		struct tcp_pcb *pcb = client_pcbs[i];
+		auto &client = clients[i];
+		if (!pcb || !client.websocket || client.responding() || !(client.websocket_topics & (1u << topic)))
+			continue;
+		err_t err = send_websocket_frame(pcb, websocket_opcode::TEXT, prefix.sv(), message);
+		if (err == ERR_MEM) // slow subscriber, skips this message
+			continue;
+		if (err != ERR_OK) {
+			LogWarning("Failed to publish websocket message to client {}: {}", i, err);
+			tcp_server_internal::tcp_server_result template_args_pure(this, -1, pcb);
+			continue;
+		}
+		client.last_activity_ms = tcp_server_internal::now_ms();
+	}
+	lwip_unlock();
+}
+
+template template_args
+err_t tcp_server template_args_pure::process_request(const message_buffer &recieve_buffer, client_state &client, struct tcp_pcb *tpcb) {
 	int free_send_idx = 0;
 	// the following also atomically reservers a buffer
 	for (; (uint32_t)free_send_idx < send_buffers.size() && send_buffers[free_send_idx].used.exchange(true) ; ++free_send_idx);
 	if ((uint32_t)free_send_idx >= send_buffers.size()) {
-		LogError("No free buffer for sending found, dropping request");
-		recieve_buffer.clear();
-		return;
+		// constant response sent by reference, the client retries after a second
+		static constexpr std::string_view busy_response{"HTTP/1.1 503 Service Unavailable\r\nServer: LacheiEmbed(josefstumpfegger@outlook.de)\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n"};
+		LogWarning("No free buffer for sending found, answering 503");
+		client.pending_body = busy_response;
+		client.close_after_send = !recieve_buffer.req_keep_alive();
+		return continue_response(client, tpcb);
 	}
 
 	auto &send_buffer = send_buffers[free_send_idx];
-	send_buffer.tpcb = client;
+	send_buffer.tpcb = tpcb;
 	send_buffer.parent_server = this;
-
-	recieve_buffer.req_update_structured_views(); // parsing the recieve buffer
+	send_buffer.keep_alive = recieve_buffer.req_keep_alive();
 
 	LogInfo("Processing request frame and generating result {} {}", recieve_buffer.method, recieve_buffer.path);
-	const auto prefixed_callback_call = [this, &recieve_buffer, &send_buffer](const auto &endpoints) {
-		for (const auto &[flags, prefix, callback]: endpoints) {
-			if ((flags.path_match && recieve_buffer.path == prefix.data()) ||
-			    (!flags.path_match && recieve_buffer.path.starts_with(prefix.data()))) {
-				callback(recieve_buffer, send_buffer);
-				return;
-			}
-		}
+	int endpoint = router::find(recieve_buffer.method_id, recieve_buffer.path);
+	if (endpoint < 0 || !endpoints[endpoint])
 		default_endpoint_cb(recieve_buffer, send_buffer);
-	};
-	if (recieve_buffer.method == "GET") 
-		prefixed_callback_call(get_endpoints);
-	else if (recieve_buffer.method == "POST") 
-		prefixed_callback_call(post_endpoints);
-	else if (recieve_buffer.method == "PUT")
-		prefixed_callback_call(put_endpoints);
-	else if (recieve_buffer.method == "DELETE")
-		prefixed_callback_call(delete_endpoints);
 	else
-		default_endpoint_cb(recieve_buffer, send_buffer);
+		endpoints[endpoint](recieve_buffer, send_buffer);
+
+	client.response = &send_buffer;
+	client.pending_head = send_buffer.buffer.sv();
+	client.pending_body = send_buffer.static_body;
+	client.close_after_send = !send_buffer.keep_alive && !send_buffer.event_stream && !send_buffer.websocket;
+	client.event_stream = send_buffer.event_stream;
+	client.websocket = send_buffer.websocket;
+	return continue_response(client, tpcb);
+}
 
-	send_data(send_buffer.buffer.sv(), client);
-	recieve_buffer.clear();
-	send_buffer.clear();
+template template_args
+err_t tcp_server template_args_pure::receive(client_state &client, struct tcp_pcb *tpcb) {
+	int client_idx = &client - clients.data();
+	auto &buffer = recieve_buffers[client_idx].buffer;
+	err_t err = process_requests(client, tpcb);
+	// stops if the buffer is full with a response being written or the connection was closed (which frees rx_pending)
+	while (err == ERR_OK && client.rx_pending && client_pcbs[client_idx] == tpcb) {
+		int free_space = int(buffer.storage.size()) - 1 - buffer.size(); // 1 byte reserved to null terminate the body
+		if (free_space <= 0)
+			break;
+		u16_t copied = pbuf_copy_partial(client.rx_pending, buffer.data() + buffer.size(), std::min<int>(free_space, client.rx_pending->tot_len), 0);
+		buffer.set_size(buffer.size() + copied);
+		client.rx_pending = pbuf_free_header(client.rx_pending, copied);
+		tcp_recved(tpcb, copied);
+		err = process_requests(client, tpcb);
+	}
+	return err;
 }
 
 template template_args
-err_t tcp_server template_args_pure::send_data(std::string_view data, struct tcp_pcb *client) {
-	int retry = 10; // give 10 retries
-	while (data.size()) {
-		uint32_t free_space = std::min<uint32_t>(tcp_sndbuf(client), data.size());
+err_t tcp_server template_args_pure::process_requests(client_state &client, struct tcp_pcb *tpcb) {
+	int client_idx = &client - clients.data();
+	auto &recieve_buffer = recieve_buffers[client_idx];
+	err_t err = ERR_OK;
+	// stops if the connection was closed after a response
+	while (client_pcbs[client_idx] == tpcb && !client.responding() && !client.websocket) {
+		if (!recieve_buffer.req_parse()) {
+			if (!recieve_buffer.req_too_large())
+				break;
+			// constant responses sent by reference, the connection is closed as the rest of the request is not read
+			static constexpr std::string_view content_too_large{"HTTP/1.1 413 Content Too Large\r\nServer: LacheiEmbed(josefstumpfegger@outlook.de)\r\nConnection: close\r\nContent-Length: 0\r\n\r\n"};
+			static constexpr std::string_view headers_too_large{"HTTP/1.1 431 Request Header Fields Too Large\r\nServer: LacheiEmbed(josefstumpfegger@outlook.de)\r\nConnection: close\r\nContent-Length: 0\r\n\r\n"};
+			bool body = recieve_buffer.state == message_buffer::parse_state::body;
+			LogWarning("Request too large ({} bytes body), answering {}", recieve_buffer.content_length, body ? 413: 431);
+			recieve_buffer.clear();
+			client.pending_body = body ? content_too_large: headers_too_large;
+			client.close_after_send = true;
+			err = continue_response(client, tpcb);
+			break;
+		}
+		char *body_end = recieve_buffer.buffer.data() + recieve_buffer.parsed_size;
+		char next = *body_end;
+		*body_end = '\0'; // null terminated body for the endpoints, restored for the next pipelined request
+		err = process_request(recieve_buffer, client, tpcb);
+		*body_end = next;
+		recieve_buffer.req_consume();
+	}
+	// frames following the upgrade request are handled once the 101 response is written
+	if (err == ERR_OK && client_pcbs[client_idx] == tpcb && !client.responding() && client.websocket)
+		err = process_websocket_frames(client, tpcb);
+	return err == ERR_ABRT ? ERR_ABRT: ERR_OK;
+}
 
-		err_t err = tcp_write(client, data.data(), free_space, 0);
-		if (err != ERR_OK) {
-			LogWarning("Failed to write data {}, retries left {}", err, retry);
-			if (--retry > 0) {
-        			vTaskDelay(pdMS_TO_TICKS(10));
-				continue;
+template template_args
+err_t tcp_server template_args_pure::process_websocket_frames(client_state &client, struct tcp_pcb *tpcb) {
+	int client_idx = &client - clients.data();
+	auto &buffer = recieve_buffers[client_idx].buffer;
+	while (client_pcbs[client_idx] == tpcb) {
+		websocket_frame frame{};
+		int size = websocket_parse_frame(buffer.data(), buffer.size(), buffer.storage.size() - 1, frame);
+		if (size == 0)
+			return ERR_OK;
+		if (size < 0) {
+			LogWarning("Invalid websocket frame, closing with {}", -size);
+			uint16_t code = -size;
+			char payload[2]{char(code >> 8), char(code & 0xff)};
+			send_websocket_frame(tpcb, websocket_opcode::CLOSE, {payload, 2});
+			return tcp_server_internal::tcp_server_result template_args_pure(this, -1, tpcb);
+		}
+
+		switch (frame.opcode) {
+		case websocket_opcode::TEXT: {
+			if (!frame.fin) {
+				LogWarning("Fragmented websocket messages are not supported");
+				break;
+			}
+			std::string_view topic = frame.payload.substr(std::min<size_t>(1, frame.payload.size()));
+			auto it = std::find(websocket_topics.begin(), websocket_topics.end(), topic);
+			if (frame.payload.empty() || it == websocket_topics.end() || (frame.payload[0] != '+' && frame.payload[0] != '-')) {
+				LogWarning("Unknown websocket message {}", frame.payload);
+				break;
 			}
-			return tcp_server_internal::tcp_server_result template_args_pure(this, -1, client);
+			uint32_t bit = 1u << (it - websocket_topics.begin());
+			if (frame.payload[0] == '+') {
+				client.websocket_topics |= bit;
+				new_websocket_subscriptions |= bit;
+			} else {
+				client.websocket_topics &= ~bit;
+			}
+			break;
 		}
-		data = data.substr(free_space);
-		err = tcp_output(client);
-		if (err != ERR_OK) {
-			LogError("Failed to output data {}", err);
-			return tcp_server_internal::tcp_server_result template_args_pure(this, -1, client);
+		case websocket_opcode::PING:
+			send_websocket_frame(tpcb, websocket_opcode::PONG, frame.payload);
+			break;
+		case websocket_opcode::CLOSE:
+			// the status code is echoed and the connection closed after the frame is sent
+			send_websocket_frame(tpcb, websocket_opcode::CLOSE, frame.payload.substr(0, 2));
+			return tcp_server_internal::tcp_server_result template_args_pure(this, -1, tpcb);
+		case websocket_opcode::PONG:
+			client.websocket_ping_sent = false;
+			break;
+		default:
+			LogWarning("Ignoring websocket frame with opcode {}", int(frame.opcode));
+			break;
 		}
+
+		int rest = buffer.size() - size;
+		std::copy_n(buffer.data() + size, rest, buffer.data());
+		buffer.set_size(rest);
 	}
 	return ERR_OK;
 }
 
+template template_args
+err_t tcp_server template_args_pure::send_websocket_frame(struct tcp_pcb *tpcb, websocket_opcode opcode, std::string_view prefix, std::string_view payload) {
+	std::array<uint8_t, 4> header{};
+	int payload_size = prefix.size() + payload.size();
+	int header_size = websocket_frame_header(header, opcode, payload_size);
+	if (tcp_sndbuf(tpcb) < header_size + payload_size || tcp_sndqueuelen(tpcb) + 3 > TCP_SND_QUEUELEN)
+		return ERR_MEM;
+	err_t err = tcp_write(tpcb, header.data(), header_size, TCP_WRITE_FLAG_COPY | (payload_size ? TCP_WRITE_FLAG_MORE: 0));
+	if (err == ERR_OK && prefix.size())
+		err = tcp_write(tpcb, prefix.data(), prefix.size(), TCP_WRITE_FLAG_COPY | (payload.size() ? TCP_WRITE_FLAG_MORE: 0));
+	if (err == ERR_OK && payload.size())
+		err = tcp_write(tpcb, payload.data(), payload.size(), TCP_WRITE_FLAG_COPY);
+	if (err == ERR_OK)
+		err = tcp_output(tpcb);
+	return err;
+}
+
+template template_args
+err_t tcp_server template_args_pure::continue_response(client_state &client, struct tcp_pcb *tpcb) {
+	// the head lives in the reused send buffer and is copied, the static body is referenced
+	const auto write_pending = [tpcb](std::string_view &pending, u8_t flags, bool more_follows) -> err_t {
+		while (pending.size()) {
+			uint32_t size = std::min<uint32_t>(tcp_sndbuf(tpcb), pending.size());
+			if (size == 0 || tcp_sndqueuelen(tpcb) >= TCP_SND_QUEUELEN)
+				return ERR_INPROGRESS; // continued in the sent callback
+			bool more = more_follows || size < pending.size();
+			err_t err = tcp_write(tpcb, pending.data(), size, flags | (more ? TCP_WRITE_FLAG_MORE: 0));
+			if (err == ERR_MEM)
+				return ERR_INPROGRESS;
+			if (err != ERR_OK)
+				return err;
+			pending.remove_prefix(size);
+		}
+		return ERR_OK;
+	};
+	err_t err = write_pending(client.pending_head, TCP_WRITE_FLAG_COPY, client.pending_body.size());
+	if (err == ERR_OK)
+		err = write_pending(client.pending_body, 0, false);
+	if (err != ERR_OK && err != ERR_INPROGRESS) {
+		LogError("Failed to write data {}", err);
+		return tcp_server_internal::tcp_server_result template_args_pure(this, -1, tpcb);
+	}
+	err = tcp_output(tpcb);
+	if (err != ERR_OK) {
+		LogError("Failed to output data {}", err);
+		return tcp_server_internal::tcp_server_result template_args_pure(this, -1, tpcb);
+	}
+	if (client.pending_head.size() || client.pending_body.size())
+		return ERR_OK;
+
+	bool close_after_send = client.close_after_send;
+	client.reset_response();
+	if (close_after_send) {
+		LogInfo("Closing client after response");
+		return tcp_server_internal::tcp_server_result template_args_pure(this, -1, tpcb);
+	}
+	return ERR_OK;
+}
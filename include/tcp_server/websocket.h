@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+#include "static_types.h"
+
+#include "mbedtls/sha1.h"
+#include "mbedtls/base64.h"
+
+/**
+ * @brief Helpers for the websocket protocol (rfc 6455) used by the tcp_server after a connection upgrade.
+ * Only unfragmented messages with up to 64k payload are supported, which is plenty for control and topic messages.
+ */
+
+enum struct websocket_opcode: uint8_t {
+	CONTINUATION = 0x0,
+	TEXT = 0x1,
+	BINARY = 0x2,
+	CLOSE = 0x8,
+	PING = 0x9,
+	PONG = 0xa,
+};
+
+constexpr uint16_t WEBSOCKET_CLOSE_NORMAL{1000};
+constexpr uint16_t WEBSOCKET_CLOSE_PROTOCOL_ERROR{1002};
+constexpr uint16_t WEBSOCKET_CLOSE_TOO_BIG{1009};
+
+struct websocket_frame {
+	websocket_opcode opcode{};
+	bool fin{};
+	std::string_view payload{}; // already unmasked
+	int size{}; // size of the whole frame including the header
+};
+
+/** @brief parses a masked client frame at the start of data and unmasks its payload in place
+  * @return size of the frame, 0 if more data is needed, -WEBSOCKET_CLOSE_* if the frame is invalid */
+inline int websocket_parse_frame(char *data, int size, int max_size, websocket_frame &frame) {
+	if (size < 2)
+		return 0;
+	uint8_t b0 = data[0], b1 = data[1];
+	if (!(b1 & 0x80)) // clients have to mask their frames
+		return -WEBSOCKET_CLOSE_PROTOCOL_ERROR;
+	int payload_size = b1 & 0x7f;
+	int header_size = 2 + 4;
+	if (payload_size == 127)
+		return -WEBSOCKET_CLOSE_TOO_BIG;
+	if (payload_size == 126) {
+		if (size < 4)
+			return 0;
+		payload_size = (uint8_t(data[2]) << 8) | uint8_t(data[3]);
+		header_size += 2;
+	}
+	if (header_size + payload_size > max_size)
+		return -WEBSOCKET_CLOSE_TOO_BIG;
+	if (size < header_size + payload_size)
+		return 0;
+	const char *mask = data + header_size - 4;
+	char *payload = data + header_size;
+	for (int i = 0; i < payload_size; ++i)
+		payload[i] ^= mask[i & 3];
+	frame = {.opcode = websocket_opcode(b0 & 0x0f), .fin = bool(b0 & 0x80), .payload = {payload, size_t(payload_size)}, .size = header_size + payload_size};
+	return frame.size;
+}
+
+/** @brief writes the header of an unmasked server frame
+  * @return size of the header */
+inline int websocket_frame_header(std::array<uint8_t, 4> &header, websocket_opcode opcode, uint16_t payload_size) {
+	header[0] = 0x80 | uint8_t(opcode); // always a final frame
+	if (payload_size < 126) {
+		header[1] = payload_size;
+		return 2;
+	}
+	header[1] = 126;
+	header[2] = payload_size >> 8;
+	header[3] = payload_size & 0xff;
+	return 4;
+}
+
+/** @brief computes the Sec-WebSocket-Accept value for the Sec-WebSocket-Key of the upgrade request */
+inline static_string<32> websocket_accept_key(std::string_view key) {
+	static constexpr std::string_view GUID{"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"};
+	std::array<uint8_t, 20> sha{};
+	mbedtls_sha1_context ctx;
+	mbedtls_sha1_init(&ctx);
+	mbedtls_sha1_starts(&ctx);
+	mbedtls_sha1_update(&ctx, (const uint8_t*)key.data(), key.size());
+	mbedtls_sha1_update(&ctx, (const uint8_t*)GUID.data(), GUID.size());
+	mbedtls_sha1_finish(&ctx, sha.data());
+	mbedtls_sha1_free(&ctx);
+
+	static_string<32> accept{};
+	size_t written{};
+	mbedtls_base64_encode((uint8_t*)accept.data(), accept.storage.size(), &written, sha.data(), sha.size());
+	accept.set_size(written);
+	return accept;
+}
@@ -11,15 +11,9 @@
 // handle exactly one command from the input stream at a time (should be called in an endless loop)
 static constexpr inline void handle_usb_command(std::istream &in = std::cin, std::ostream &out = std::cout) {
 	const auto print_logs = [&out]{
-		for (const auto& log: log_storage::Default().logs) {
-			switch(log.severity) {
-			case log_severity::Info   : out << "[Info   ]: "; break;
-			case log_severity::Warning: out << "[Warning]: "; break;
-			case log_severity::Error  : out << "[Error  ]: "; break;
-			case log_severity::Fatal  : out << "[Fatal  ]: "; break;
-			}
-			out << log.message.sv() << '\n';
-		}
+		log_storage::Default().for_each([&out](log_severity severity, std::string_view message) {
+			out << log_storage::severity_prefixes[int(severity)] << message << '\n';
+		});
 	};
 
 	std::string command;
@@ -96,6 +90,7 @@ static constexpr inline void handle_usb_command(std::istream &in = std::cin, std
 		if (PICO_OK != persistent_storage_t::Default().write(
 			wifi_storage::Default().pwd_wifi, &persistent_storage_layout::pwd_wifi))
 			LogError("Failed to store pwd_wifi");
+		persistent_storage_t::Default().request_commit();
 #endif
 	} else if (command == "set_log_level" || command == "sll") {
 		std::string level;
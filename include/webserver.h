@@ -3,34 +3,185 @@
 #include <span>
 
 #include "static_types.h"
+#include "measurement_json.h"
+#include "measurement_history.h"
 #include "tcp_server/tcp_server.h"
 #include "modbus-meter-html.h"
 #include "wifi_storage.h"
 #include "access_point.h"
 #include "persistent_storage.h"
+#include "flash_log.h"
 #include "crypto_storage.h"
 #include "ntp_client.h"
 #include "sunspec_modbus.h"
 
-using tcp_server_typed = tcp_server<13, 5, 2, 0>;
-tcp_server_typed& Webserver() {
-	const auto static_page_callback = [] (std::string_view page, std::string_view status, std::string_view type = "text/html") {
-		return [page, status, type](const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res){
-			res.res_set_status_line(HTTP_VERSION, status);
-			res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
-			res.res_add_header("Content-Type", type);
-			res.res_add_header("Content-Length", static_format<8>("{}", page.size()));
-			res.res_write_body(page);
-		};
+/** @brief all paths served by the webserver, the callbacks are bound to them by method and path in Webserver() */
+inline constexpr std::array webserver_routes{
+	// meter endpoints
+	route{http_method::GET, "/measurements"},
+	route{http_method::GET, "/measurement_events"},
+	route{http_method::GET, "/measurements.bin"},
+	route{http_method::GET, "/ws"},
+	route{http_method::GET, "/history"},
+	route{http_method::GET, "/flash_log"},
+	// interactive endpoints
+	route{http_method::GET, "/logs"},
+	route{http_method::GET, "/discovered_wifis"},
+	route{http_method::GET, "/host_name"},
+	route{http_method::GET, "/ap_active"},
+	// auth endpoints
+	route{http_method::GET, "/user"},
+	// time endpoint
+	route{http_method::GET, "/time"},
+	// static file serve endpoints
+	route{http_method::GET, "/"},
+	route{http_method::GET, "/index.html"},
+	route{http_method::GET, "/style.css"},
+	route{http_method::GET, "/internet.html"},
+	route{http_method::GET, "/overview.html"},
+	route{http_method::GET, "/settings.html"},
+	// post endpoints
+	route{http_method::POST, "/set_log_level"},
+	route{http_method::POST, "/host_name"},
+	route{http_method::POST, "/ap_active"},
+	route{http_method::POST, "/wifi_connect"},
+	route{http_method::POST, "/login"},
+	// put endpoints
+	route{http_method::PUT, "/set_password"},
+	route{http_method::PUT, "/time"},
+};
+
+using tcp_server_typed = tcp_server<webserver_routes>;
+
+/** @brief topics of the live data websocket (/ws), a browser subscribes with "+<name>" and gets "<name> <data>" messages */
+enum struct websocket_topic: int {
+	measurements,
+	logs,
+	time,
+	wifis,
+};
+inline constexpr std::array<std::string_view, 4> websocket_topic_names{"measurements", "logs", "time", "wifis"};
+
+constexpr std::string_view CONTENT_TYPE_HTML{"text/html"};
+constexpr std::string_view CONTENT_TYPE_CSS{"text/css"};
+
+/** @brief endpoint serving an embedded page (gzip compressed by the build), instantiated per page so that it is a plain function.
+  * Pages served with STATUS_OK carry their content hash as ETag and have to be revalidated by the browser,
+  * which then gets a bodyless 304 as long as the firmware did not change the page */
+template<const embedded_file &page, const std::string_view &status, const std::string_view &type = CONTENT_TYPE_HTML>
+void static_page_callback(const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	constexpr bool cacheable = status == STATUS_OK;
+	if (cacheable && req.headers_view.get_header("If-None-Match").find(page.etag) != std::string_view::npos) {
+		res.res_set_status_line(HTTP_VERSION, STATUS_NOT_MODIFIED);
+		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res.res_add_header("ETag", page.etag);
+		res.res_add_header("Cache-Control", "no-cache");
+		res.res_write_body();
+		return;
+	}
+	res.res_set_status_line(HTTP_VERSION, status);
+	res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+	res.res_add_header("Content-Type", type);
+	if (page.gzip)
+		res.res_add_header("Content-Encoding", "gzip");
+	if (cacheable) {
+		res.res_add_header("ETag", page.etag);
+		res.res_add_header("Cache-Control", "no-cache");
+	}
+	res.res_add_header("Content-Length", static_format<8>("{}", page.data.size()));
+	res.res_write_static_body(page.data);
+}
+
+/**
+ * @brief binary snapshot of the measurements for data collectors (GET /measurements.bin[?since=<seq>])
+ * All fields little endian:
+ * uint8_t  version (1)
+ * uint8_t  field count of the mapping (values are in the order of eastron_sunspec_mapping, same as the json)
+ * uint16_t reserved
+ * uint32_t seq, to be given as since for the next request
+ * uint32_t fields, bit i set if value i is contained
+ * float    values of the set bits in ascending order
+ * Without since all values are contained, with since only the values changed after that sequence number.
+ */
+constexpr uint8_t MEASUREMENT_SNAPSHOT_VERSION{1};
+constexpr int measurement_snapshot_max_size = 12 + 4 * eastron_sunspec_mapping.size();
+
+template<int N>
+void write_measurement_snapshot(static_string<N> &s, uint32_t since) {
+	static_assert(N >= measurement_snapshot_max_size);
+	tracked_registers<eastron_sunspec_mapping> m{};
+	g::sunspec_values().read(m);
+	uint32_t fields = m.changed_since(since);
+	const auto append_raw = [&s](const auto &v) { s.append(std::string_view{reinterpret_cast<const char*>(&v), sizeof(v)}); };
+	append_raw(MEASUREMENT_SNAPSHOT_VERSION);
+	append_raw(uint8_t(m.SIZE));
+	append_raw(uint16_t{});
+	append_raw(m.seq);
+	append_raw(fields);
+	for (int i = 0; i < m.SIZE; ++i)
+		if (fields & (1u << i))
+			append_raw(m.registers.values[i]);
+}
+
+/**
+ * @brief stored measurement history for charts and billing (GET /history?res=<1|60|900>[&from=<s>][&to=<s>])
+ * from and to are device times (see measurement_history), without them all stored samples of the resolution are sent.
+ * If not all blocks fit into the response, the remaining ones are requested with from set to next.
+ * All fields little endian:
+ * uint8_t  version (1)
+ * uint8_t  channel count (values are in the order of measurement_history_channels)
+ * uint16_t interval in seconds
+ * uint32_t device time of the response
+ * uint32_t unix time at the device time of the response, 0 if the clock is not set
+ * uint32_t next, 0 if all blocks are contained
+ * uint8_t  per channel: decimals, bit 7 set for counter channels
+ * blocks as described in measurement_history, each with
+ *   uint32_t start device time, uint16_t sample count, uint16_t block size including this header
+ *   per sample and channel a zigzag varint: the value for the first sample of the block, afterwards the difference
+ *   to the previous value, for counter channels the difference to the previous difference (0 before the second sample)
+ */
+constexpr uint8_t MEASUREMENT_HISTORY_VERSION{1};
+
+/** @return amount of written bytes, 0 if there is no history with the interval */
+template<int N>
+int write_measurement_history(static_string<N> &s, uint32_t interval_s, uint32_t from, uint32_t to) {
+	auto &history = g::history();
+	const auto append_raw = [&s](const auto &v) { s.append(std::string_view{reinterpret_cast<const char*>(&v), sizeof(v)}); };
+	const auto write = [&](const auto &tier) {
+		int start = s.size();
+		append_raw(MEASUREMENT_HISTORY_VERSION);
+		append_raw(uint8_t(history.SIZE));
+		append_raw(uint16_t(interval_s));
+		append_raw(uint32_t(time_us_64() / 1000000));
+		append_raw(uint32_t(ntp_client::Default().ntp_time ? ntp_client::Default().get_time_since_epoch(): 0));
+		int next_offset = s.size();
+		append_raw(uint32_t{});
+		for (const auto &channel: measurement_history_channels)
+			append_raw(uint8_t(channel.decimals | (channel.counter ? 0x80: 0)));
+		uint32_t next{};
+		std::span<uint8_t> free{reinterpret_cast<uint8_t*>(s.data() + s.size()), size_t(N - s.size())};
+		s.set_size(s.size() + history.read(tier, from, to, free, next));
+		std::memcpy(s.data() + next_offset, &next, sizeof(next));
+		return s.size() - start;
 	};
-	const auto fill_unauthorized = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	switch (interval_s) {
+	case 1: return write(history.seconds);
+	case 60: return write(history.minutes);
+	case 900: return write(history.quarters);
+	default: return 0;
+	}
+}
+
+tcp_server_typed& Webserver() {
+	// all endpoints are captureless and stored as function pointers
+	static constexpr auto fill_unauthorized = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		res.res_set_status_line(HTTP_VERSION, STATUS_UNAUTHORIZED);
 		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
 		res.res_add_header("WWW-Authenticate", static_format<128>(R"(Digest algorithm="{}",nonce="{:x}",realm="{}",qop="{}")", crypto_storage::algorithm, time_us_64(), crypto_storage::realm, crypto_storage::qop));
 		res.res_add_header("Content-Length", "0");
 		res.res_write_body();
 	};
-	const auto post_login = [&fill_unauthorized] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	static constexpr auto post_login = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		std::string_view auth_header = req.headers_view.get_header("Authorization");
 		if (auth_header.empty() || crypto_storage::Default().check_authorization(req.method, auth_header).empty()) {
 			fill_unauthorized(req, res);
@@ -41,7 +192,7 @@ tcp_server_typed& Webserver() {
 		res.res_add_header("Content-Length", "0");
 		res.res_write_body();
 	};
-	const auto get_user = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	static constexpr auto get_user = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		std::string_view user{};
 		std::string_view auth_header = req.headers_view.get_header("Authorization");
 		if (auth_header.size()) {
@@ -52,7 +203,7 @@ tcp_server_typed& Webserver() {
 		res.res_add_header("Content-Length", static_format<8>("{}", user.size()));
 		res.res_write_body(user);
 	};
-	const auto get_time = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	static constexpr auto get_time = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		if (ntp_client::Default().ntp_time == 0) {
 			res.res_set_status_line(HTTP_VERSION, STATUS_INTERNAL_SERVER_ERROR);
 			res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
@@ -64,92 +215,100 @@ tcp_server_typed& Webserver() {
 		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
 		auto length_hdr = res.res_add_header("Content-Length", "    ").value;
 		res.res_write_body();
-		int size = res.buffer.append_formatted("{}", ntp_client::Default().get_time_since_epoch());
+		int size = res.buffer.append_int(ntp_client::Default().get_time_since_epoch());
 		if (0 == format_to_sv(length_hdr, "{}", size))
 			LogError("Failed to write header length");
 	};
-	const auto set_time = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	static constexpr auto set_time = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		ntp_client::Default().set_time_since_epoch(strtoul(req.body.data(), nullptr, 10));
 		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
 		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
 		res.res_add_header("Content-Length", "0");
 		res.res_write_body();
 	};
-	const auto get_measurements = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	static constexpr auto get_measurements = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
 		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
 		res.res_add_header("Content-Type", "application/json");
+		tracked_registers<eastron_sunspec_mapping> m{};
+		g::sunspec_values().read(m);
+		measurement_json json{m.registers};
+		res.res_add_header("Content-Length", static_format<8>("{}", json.size()));
+		res.res_write_body(); // add header end sequence
+		json.append_to(res.buffer);
+	};
+	static constexpr auto get_measurement_events = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		// the frames are pushed by update_meter_task via publish_event()
+		res.res_start_event_stream();
+	};
+	static constexpr auto get_measurements_bin = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		uint32_t since{};
+		if (!query_param(req.query, "since", since)) {
+			res.res_set_status_line(HTTP_VERSION, STATUS_BAD_REQUEST);
+			res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+			res.res_add_header("Content-Length", "0");
+			res.res_write_body();
+			return;
+		}
+		static_string<measurement_snapshot_max_size> snapshot{};
+		write_measurement_snapshot(snapshot, since);
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res.res_add_header("Content-Type", "application/octet-stream");
+		res.res_add_header("Content-Length", static_format<8>("{}", snapshot.size()));
+		res.res_write_body(snapshot.sv());
+	};
+	static constexpr auto get_history = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		uint32_t interval_s{60}, from{}, to{UINT32_MAX};
+		if (!query_param(req.query, "res", interval_s) || !query_param(req.query, "from", from) || !query_param(req.query, "to", to) ||
+		    (interval_s != 1 && interval_s != 60 && interval_s != 900)) {
+			res.res_set_status_line(HTTP_VERSION, STATUS_BAD_REQUEST);
+			res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+			res.res_add_header("Content-Length", "0");
+			res.res_write_body();
+			return;
+		}
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res.res_add_header("Content-Type", "application/octet-stream");
 		auto length_hdr = res.res_add_header("Content-Length", "        ").value; // at max 8 chars for size
-		res.res_write_body("{"); // add header end sequence
-		ls::modbus_actor<sunspec_layout, tcp_io>& s = g::sunspec_modbus();
-		scoped_lock lock{g::sunspec_mutex()};
-		res.buffer.append_formatted( "\"neutral_volt_1\":{:.2f},"
-			      "\"neutral_volt_2\":{:.2f},"
-			      "\"neutral_volt3\":{:.2f},"
-			      "\"current_1\":{:.2f},"
-			      "\"current_2\":{:.2f},"
-			      "\"current3\":{:.2f},"
-			      "\"active_power_1\":{:.2f},"
-			      "\"active_power_2\":{:.2f},"
-			      "\"active_power3\":{:.2f},"
-			      "\"apparent_power_1\":{:.2f},"
-			      "\"apparent_power_2\":{:.2f},"
-			      "\"apparent_power3\":{:.2f},"
-			      "\"reactive_power_1\":{:.2f},"
-			      "\"reactive_power_2\":{:.2f},"
-			      "\"reactive_power3\":{:.2f},"
-			      "\"reactive_power_1\":{:.2f},"
-			      "\"reactive_power_2\":{:.2f},"
-			      "\"reactive_power3\":{:.2f},"
-			      "\"line_to_line_volt_1\":{:.2f},"
-			      "\"line_to_line_volt_2\":{:.2f},"
-			      "\"line_to_line_volt3\":{:.2f},"
-			      "\"avg_neutral_volt\":{:.2f},"
-			      "\"avg_current\":{:.2f},"
-			      "\"tot_power\":{:.2f},"
-			      "\"tot_apparent_power\":{:.2f},"
-			      "\"tot_reactive_power\":{:.2f},"
-			      "\"tot_power_factor\":{:.2f},"
-			      "\"frequency\":{:.2f},"
-			      "\"avg_line_to_line_volt\":{:.2f},"
-			      "\"tot_importet_energy\":{:.2f},"
-			      "\"to_exported_energy\":{:.2f}",
-			      s.read(&halfs_sunspec::phvpha),
-			      s.read(&halfs_sunspec::phvphb),
-			      s.read(&halfs_sunspec::phvphc),
-			      s.read(&halfs_sunspec::apha),	
-			      s.read(&halfs_sunspec::aphb),	
-			      s.read(&halfs_sunspec::aphc),
-			      s.read(&halfs_sunspec::wpha),	
-			      s.read(&halfs_sunspec::wphb),	
-			      s.read(&halfs_sunspec::wphc),
-			      s.read(&halfs_sunspec::vapha),	
-			      s.read(&halfs_sunspec::vaphb),	
-			      s.read(&halfs_sunspec::vaphc),
-			      s.read(&halfs_sunspec::varpha),	
-			      s.read(&halfs_sunspec::varphb),	
-			      s.read(&halfs_sunspec::varphc),
-			      s.read(&halfs_sunspec::pfpha),	
-			      s.read(&halfs_sunspec::pfphb),	
-			      s.read(&halfs_sunspec::pfphc),
-			      s.read(&halfs_sunspec::ppvphab),	
-			      s.read(&halfs_sunspec::ppvphbc),	
-			      s.read(&halfs_sunspec::ppvphca),
-			      s.read(&halfs_sunspec::phv),
-			      s.read(&halfs_sunspec::a),
-			      s.read(&halfs_sunspec::w),
-			      s.read(&halfs_sunspec::va),
-			      s.read(&halfs_sunspec::var),
-			      s.read(&halfs_sunspec::pf),
-			      s.read(&halfs_sunspec::hz),
-			      s.read(&halfs_sunspec::ppv),
-			      s.read(&halfs_sunspec::totwhimp),
-			      s.read(&halfs_sunspec::totwhexp));
-		res.res_write_body("}");
-		if (0 == format_to_sv(length_hdr, "{}", res.body.size()))
+		res.res_write_body(); // add header end sequence
+		int body_size = write_measurement_history(res.buffer, interval_s, from, to);
+		if (0 == format_to_sv(length_hdr, "{}", body_size))
 			LogError("Failed to write header length");
 	};
-	const auto get_logs = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	static constexpr auto get_flash_log = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		// raw sector of the flash log (see flash_log) in pieces of at most the free send buffer, copied as the sector
+		// might be erased before it is acknowledged. The piece at offset of sector X-Sector-Seq is sent, further pieces
+		// are requested with that seq and the offset advanced by the body size up to X-Sector-Size, the next sector with seq + 1
+		uint32_t seq{}, offset{}, size{};
+		bool valid = query_param(req.query, "seq", seq) && query_param(req.query, "offset", offset) && offset <= FLASH_SECTOR_SIZE;
+		if (!valid || flash_log_t::Default().read_sector(seq, offset, {}, size) < 0) {
+			res.res_set_status_line(HTTP_VERSION, valid ? STATUS_NOT_FOUND: STATUS_BAD_REQUEST);
+			res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+			res.res_add_header("Content-Length", "0");
+			res.res_write_body();
+			return;
+		}
+		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
+		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
+		res.res_add_header("Content-Type", "application/octet-stream");
+		auto seq_hdr = res.res_add_header("X-Sector-Seq", "          ").value; // at max 10 chars for the seq
+		auto size_hdr = res.res_add_header("X-Sector-Size", "    ").value;
+		auto length_hdr = res.res_add_header("Content-Length", "    ").value;
+		res.res_write_body(); // add header end sequence
+		int copied = flash_log_t::Default().read_sector(seq, offset, {res.buffer.data() + res.buffer.size(), size_t(res.buffer.storage.size() - res.buffer.size())}, size);
+		if (copied < 0) // erased since the check above, an empty sector makes the client continue with the next one
+			copied = size = 0;
+		res.buffer.set_size(res.buffer.size() + copied);
+		if (0 == format_to_sv(seq_hdr, "{}", seq) || 0 == format_to_sv(size_hdr, "{}", size) || 0 == format_to_sv(length_hdr, "{}", copied))
+			LogError("Failed to write flash log headers");
+	};
+	static constexpr auto get_websocket = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+		// the topics are published by publish_websocket_topics() and update_meter_task
+		res.res_upgrade_websocket(req);
+	};
+	static constexpr auto get_logs = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
 		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
 		res.res_add_header("Content-Type", "text/plain");
@@ -159,7 +318,7 @@ tcp_server_typed& Webserver() {
 		if (0 == format_to_sv(length_hdr, "{}", body_size))
 			LogError("Failed to write header length");
 	};
-	const auto set_log_level = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	static constexpr auto set_log_level = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		static constexpr std::string_view json_success{R"({"status":"success"})"};
 		static constexpr std::string_view json_fail{R"({"status":"error"})"};
 		LogInfo("Change log level to {}", req.body);
@@ -181,7 +340,7 @@ tcp_server_typed& Webserver() {
 		res.res_add_header("Content-Length", static_format<8>("{}", status.size()));
 		res.res_write_body(status);
 	};
-	const auto get_discovered_wifis = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	static constexpr auto get_discovered_wifis = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
 		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
 		res.res_add_header("Content-Type", "application/json");
@@ -198,14 +357,14 @@ tcp_server_typed& Webserver() {
 		if (0 == format_to_sv(length_hdr, "{}", res.body.size()))
 			LogError("Failed to write header length");
 	};
-	const auto get_hostname = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	static constexpr auto get_hostname = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
 		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
 		res.res_add_header("Content-Type", "text/plain");
 		res.res_add_header("Content-Length", static_format<8>("{}", wifi_storage::Default().hostname.size()));
 		res.res_write_body(wifi_storage::Default().hostname.sv());
 	};
-	const auto set_hostname = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	static constexpr auto set_hostname = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
 		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
 		res.res_add_header("Content-Length", "0");
@@ -216,7 +375,7 @@ tcp_server_typed& Webserver() {
 		if (PICO_OK != persistent_storage_t::Default().write(wifi_storage::Default().hostname, &persistent_storage_layout::hostname))
 			LogError("Failed to store hostname");
 	};
-	const auto get_ap_active = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	static constexpr auto get_ap_active = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		std::string_view response = access_point::Default().active ? "true": "false";
 		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
 		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
@@ -224,7 +383,7 @@ tcp_server_typed& Webserver() {
 		res.res_add_header("Content-Length", static_format<8>("{}", response.size()));
 		res.res_write_body(response);
 	};
-	const auto set_ap_active = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	static constexpr auto set_ap_active = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
 		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");
 		res.res_add_header("Content-Length", "0");
@@ -234,7 +393,7 @@ tcp_server_typed& Webserver() {
 		else
 			access_point::Default().deinit();
 	};
-	const auto connect_to_wifi = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	static constexpr auto connect_to_wifi = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		res.res_set_status_line(HTTP_VERSION, STATUS_OK);
 		res.res_add_header("Server", "LacheiEmbed(josefstumpfegger@outlook.de)");;
 		res.res_add_header("Content-Length", "0");
@@ -258,8 +417,9 @@ tcp_server_typed& Webserver() {
 			LogError("Failed to store ssid_wifi");
 		if (PICO_OK != persistent_storage_t::Default().write(wifi.pwd_wifi, &persistent_storage_layout::pwd_wifi))
 			LogError("Failed to store pwd_wifi");
+		// hostname, ssid and password are appended as one commit by the persistent storage writer task
 	};
-	const auto set_password = [&fill_unauthorized] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
+	static constexpr auto set_password = [] (const tcp_server_typed::message_buffer &req, tcp_server_typed::message_buffer &res) {
 		std::string_view auth_header = req.headers_view.get_header("Authorization");
 		if (auth_header.empty() || crypto_storage::Default().check_authorization(req.method, auth_header).empty()) {
 			fill_unauthorized(req, res);
@@ -273,39 +433,84 @@ tcp_server_typed& Webserver() {
 	};
 	static tcp_server_typed webserver{
 		.port = 80,
-		.default_endpoint_cb = static_page_callback(_404_HTML, STATUS_NOT_FOUND),
-		.get_endpoints = {
+		.default_endpoint_cb = static_page_callback<_404_HTML, STATUS_NOT_FOUND>,
+		.endpoints = tcp_server_typed::bind_endpoints({
 			// meter endpoints
-			tcp_server_typed::endpoint{{.path_match = true}, "/measurements", get_measurements},
+			{http_method::GET, "/measurements", get_measurements},
+			{http_method::GET, "/measurement_events", get_measurement_events},
+			{http_method::GET, "/measurements.bin", get_measurements_bin},
+			{http_method::GET, "/ws", get_websocket},
+			{http_method::GET, "/history", get_history},
+			{http_method::GET, "/flash_log", get_flash_log},
 			// interactive endpoints
-			tcp_server_typed::endpoint{{.path_match = true}, "/logs", get_logs},
-			tcp_server_typed::endpoint{{.path_match = true}, "/discovered_wifis", get_discovered_wifis},
-			tcp_server_typed::endpoint{{.path_match = true}, "/host_name", get_hostname},
-			tcp_server_typed::endpoint{{.path_match = true}, "/ap_active", get_ap_active},
+			{http_method::GET, "/logs", get_logs},
+			{http_method::GET, "/discovered_wifis", get_discovered_wifis},
+			{http_method::GET, "/host_name", get_hostname},
+			{http_method::GET, "/ap_active", get_ap_active},
 			// auth endpoints
-			tcp_server_typed::endpoint{{.path_match = true}, "/user", get_user},
+			{http_method::GET, "/user", get_user},
 			// time endpoint
-			tcp_server_typed::endpoint{{.path_match = true}, "/time", get_time},
+			{http_method::GET, "/time", get_time},
 			// static file serve endpoints
-			tcp_server_typed::endpoint{{.path_match = true}, "/", static_page_callback(INDEX_HTML, STATUS_OK)},
-			tcp_server_typed::endpoint{{.path_match = true}, "/index.html", static_page_callback(INDEX_HTML, STATUS_OK)},
-			tcp_server_typed::endpoint{{.path_match = true}, "/style.css", static_page_callback(STYLE_CSS, STATUS_OK, "text/css")},
-			tcp_server_typed::endpoint{{.path_match = true}, "/internet.html", static_page_callback(INTERNET_HTML, STATUS_OK)},
-			tcp_server_typed::endpoint{{.path_match = true}, "/overview.html", static_page_callback(OVERVIEW_HTML, STATUS_OK)},
-			tcp_server_typed::endpoint{{.path_match = true}, "/settings.html", static_page_callback(SETTINGS_HTML, STATUS_OK)},
-		},
-		.post_endpoints = {
-			tcp_server_typed::endpoint{{.path_match = true}, "/set_log_level", set_log_level},
-			tcp_server_typed::endpoint{{.path_match = true}, "/host_name", set_hostname},
-			tcp_server_typed::endpoint{{.path_match = true}, "/ap_active", set_ap_active},
-			tcp_server_typed::endpoint{{.path_match = true}, "/wifi_connect", connect_to_wifi},
-			tcp_server_typed::endpoint{{.path_match = true}, "/login", post_login},
-		},
-		.put_endpoints = {
-			tcp_server_typed::endpoint{{.path_match = true}, "/set_password", set_password},
-			tcp_server_typed::endpoint{{.path_match = true}, "/time", set_time},
-		}
+			{http_method::GET, "/", static_page_callback<INDEX_HTML, STATUS_OK>},
+			{http_method::GET, "/index.html", static_page_callback<INDEX_HTML, STATUS_OK>},
+			{http_method::GET, "/style.css", static_page_callback<STYLE_CSS, STATUS_OK, CONTENT_TYPE_CSS>},
+			{http_method::GET, "/internet.html", static_page_callback<INTERNET_HTML, STATUS_OK>},
+			{http_method::GET, "/overview.html", static_page_callback<OVERVIEW_HTML, STATUS_OK>},
+			{http_method::GET, "/settings.html", static_page_callback<SETTINGS_HTML, STATUS_OK>},
+			// post endpoints
+			{http_method::POST, "/set_log_level", set_log_level},
+			{http_method::POST, "/host_name", set_hostname},
+			{http_method::POST, "/ap_active", set_ap_active},
+			{http_method::POST, "/wifi_connect", connect_to_wifi},
+			{http_method::POST, "/login", post_login},
+			// put endpoints
+			{http_method::PUT, "/set_password", set_password},
+			{http_method::PUT, "/time", set_time},
+		}),
+		.websocket_topics = websocket_topic_names,
 	};
 	return webserver;
 }
 
+/** @brief publishes the slowly changing websocket topics in their interval and directly to new subscribers,
+  * to be called once a second. Measurements are published by update_meter_task on each update */
+inline void publish_websocket_topics(uint32_t cur_time_s) {
+	auto &server = Webserver();
+	if (server.websocket_subscribers() == 0)
+		return;
+	static static_string<4096> message{};
+	static std::array<uint32_t, websocket_topic_names.size()> last_publish_s{};
+	uint32_t fresh = server.take_new_websocket_subscriptions();
+	const auto due = [&](websocket_topic topic, uint32_t interval_s) {
+		if (!server.websocket_subscribers(int(topic)) || (!(fresh & (1u << int(topic))) && cur_time_s - last_publish_s[int(topic)] < interval_s))
+			return false;
+		last_publish_s[int(topic)] = cur_time_s;
+		return true;
+	};
+	if (due(websocket_topic::logs, 4)) {
+		message.clear();
+		log_storage::Default().print_errors(message);
+		server.publish_websocket(int(websocket_topic::logs), message.sv());
+	}
+	if (due(websocket_topic::time, 10) && ntp_client::Default().ntp_time != 0) {
+		message.clear();
+		message.append_int(ntp_client::Default().get_time_since_epoch());
+		server.publish_websocket(int(websocket_topic::time), message.sv());
+	}
+	if (due(websocket_topic::wifis, 4)) {
+		message.clear();
+		message.append("{\"wifis\":[");
+		bool first_iter{true};
+		for (const auto& wifi: wifi_storage::Default().wifis) {
+			bool connected = wifi_storage::Default().wifi_connected && wifi_storage::Default().ssid_wifi.sv() == wifi.ssid.sv();
+			message.append_formatted("{}{{\"ssid\":\"{}\",\"rssi\":{},\"connected\":{}}}", (first_iter? ' ': ','),
+			       wifi.ssid.sv(), wifi.rssi, connected ? "true": "false");
+			first_iter = false;
+		}
+		message.append_formatted("],\"ap_active\":{},\"host_name\":\"{}\"}}", access_point::Default().active ? "true": "false",
+		       wifi_storage::Default().hostname.sv());
+		server.publish_websocket(int(websocket_topic::wifis), message.sv());
+	}
+}
+
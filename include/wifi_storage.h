@@ -111,6 +111,7 @@ struct wifi_storage {
 			LogError("Failed to store ssid_wifi");
 		if (PICO_OK != persistent_storage_t::Default().write(pwd_wifi, &persistent_storage_layout::pwd_wifi))
 			LogError("Failed to store pwd_wifi");
+		persistent_storage_t::Default().request_commit();
 	}
 
 	void load_from_persistent_storage() {
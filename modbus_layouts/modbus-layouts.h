@@ -173,3 +173,49 @@ struct eastron_layout {
 };
 
 
+
+/** @brief Maps a float register of a source layout to a float register of a destination layout */
+template<typename src_t, typename dst_t>
+struct register_mapping {
+	float src_t::* src;
+	float dst_t::* dst;
+	float scale{1.f};
+};
+
+/**
+* Mapping of the eastron meter registers to the sunspec meter registers.
+* Supporting a further meter model only requires a further mapping table.
+*/
+inline constexpr std::array<register_mapping<halfs_eastron, halfs_sunspec>, 31> eastron_sunspec_mapping{{
+	{&halfs_eastron::phase_1_neutral_volts,		&halfs_sunspec::phvpha},
+	{&halfs_eastron::phase_2_neutral_volts,		&halfs_sunspec::phvphb},
+	{&halfs_eastron::phase_3_neutral_volts,		&halfs_sunspec::phvphc},
+	{&halfs_eastron::phase_1_current,		&halfs_sunspec::apha},
+	{&halfs_eastron::phase_2_current,		&halfs_sunspec::aphb},
+	{&halfs_eastron::phase_3_current,		&halfs_sunspec::aphc},
+	{&halfs_eastron::phase_1_active_power,		&halfs_sunspec::wpha},
+	{&halfs_eastron::phase_2_active_power,		&halfs_sunspec::wphb},
+	{&halfs_eastron::phase_3_active_power,		&halfs_sunspec::wphc},
+	{&halfs_eastron::phase_1_apparent_power,	&halfs_sunspec::vapha},
+	{&halfs_eastron::phase_2_apparent_power,	&halfs_sunspec::vaphb},
+	{&halfs_eastron::phase_3_apparent_power,	&halfs_sunspec::vaphc},
+	{&halfs_eastron::phase_1_reactive_power,	&halfs_sunspec::varpha},
+	{&halfs_eastron::phase_2_reactive_power,	&halfs_sunspec::varphb},
+	{&halfs_eastron::phase_3_reactive_power,	&halfs_sunspec::varphc},
+	{&halfs_eastron::phase_1_power_factor,		&halfs_sunspec::pfpha},
+	{&halfs_eastron::phase_2_power_factor,		&halfs_sunspec::pfphb},
+	{&halfs_eastron::phase_3_power_factor,		&halfs_sunspec::pfphc},
+	{&halfs_eastron::line_1_to_line_2_volts,	&halfs_sunspec::ppvphab},
+	{&halfs_eastron::line_2_to_line_3_volts,	&halfs_sunspec::ppvphbc},
+	{&halfs_eastron::line_3_to_line_1_volts,	&halfs_sunspec::ppvphca},
+	{&halfs_eastron::average_line_to_neutral_volts,	&halfs_sunspec::phv},
+	{&halfs_eastron::average_line_current,		&halfs_sunspec::a},
+	{&halfs_eastron::total_system_power,		&halfs_sunspec::w},
+	{&halfs_eastron::total_system_volt_amps,	&halfs_sunspec::va},
+	{&halfs_eastron::total_system_VAr,		&halfs_sunspec::var},
+	{&halfs_eastron::total_system_power_factor,	&halfs_sunspec::pf},
+	{&halfs_eastron::frequency_of_supply_voltage,	&halfs_sunspec::hz},
+	{&halfs_eastron::average_line_to_line_volts,	&halfs_sunspec::ppv},
+	{&halfs_eastron::import_active_energy,		&halfs_sunspec::totwhimp, 1e3f}, // kWh to Wh
+	{&halfs_eastron::export_active_energy,		&halfs_sunspec::totwhexp, 1e3f}, // kWh to Wh
+}};
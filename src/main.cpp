@@ -23,9 +23,33 @@
 #include "ntp_client.h"
 #include "eastron_modbus.h"
 #include "sunspec_modbus.h"
+#include "poll_scheduler.h"
+#include "register_mapping.h"
+#include "measurement_history.h"
+#include "flash_log.h"
 #include "lwip_init.h"
 
 inline uint32_t time_s() { return time_us_64() / 1000000;  }
+/** @brief time of flash log records, unix time once the clock is set */
+inline uint32_t record_time() { return ntp_client::Default().ntp_time ? ntp_client::Default().get_time_since_epoch(): time_s(); }
+
+/** @brief keeps warnings, errors and every 15 minutes the energy counters in the flash log, to be called once a second.
+  * The records are programmed hourly, a reboot loses at max the records of the last hour */
+void persist_flash_log(uint32_t cur_time) {
+	auto &flash_log = flash_log_t::Default();
+	flash_log.persist_logs(log_storage::Default(), record_time());
+	static tracked_registers<eastron_sunspec_mapping> values{}; // static, too big for the small task stack
+	static uint32_t last_energy{}, last_flush{};
+	if (cur_time - last_energy >= 15 * 60 && g::sunspec_values().read(values)) {
+		std::array<float, 2> energy{values.registers.get<&halfs_sunspec::totwhimp>(), values.registers.get<&halfs_sunspec::totwhexp>()};
+		flash_log.append(flash_record_type::energy, record_time(), {reinterpret_cast<const uint8_t*>(energy.data()), sizeof(energy)});
+		last_energy = cur_time;
+	}
+	if (cur_time - last_flush >= 60 * 60) {
+		flash_log.flush();
+		last_flush = cur_time;
+	}
+}
 
 void usb_comm_task(void *) {
 	LogInfo("Usb communication task");
@@ -61,6 +85,8 @@ void wifi_search_task(void *) {
 			board_led_set(wifi_storage::Default().wifi_connected);
 		}
 		wifi_storage::Default().update_scanned();
+		publish_websocket_topics(cur_time);
+		persist_flash_log(cur_time);
 		if (wifi_storage::Default().wifi_connected)
 			ntp_client::Default().update_time();
 		vTaskDelay(pdMS_TO_TICKS(1000));
@@ -70,60 +96,51 @@ void wifi_search_task(void *) {
 void update_meter_task(void *) {
 	LogInfo("Update eastron values task started");
 	ls::modbus_actor<eastron_layout, rtu_io>& e = g::eastron_modbus();
-	ls::modbus_actor<sunspec_layout, tcp_io>& s = g::sunspec_modbus();
+	// power values are polled back to back, slow changing values only in their interval
+	static poll_scheduler<halfs_eastron, 4> scheduler{{{
+		{&halfs_eastron::phase_1_neutral_volts, 	&halfs_eastron::phase_3_power_factor, 		0},
+		{&halfs_eastron::average_line_to_neutral_volts, &halfs_eastron::frequency_of_supply_voltage, 	0},
+		{&halfs_eastron::import_active_energy, 		&halfs_eastron::export_active_energy, 		10'000},
+		{&halfs_eastron::line_1_to_line_2_volts, 	&halfs_eastron::average_line_to_line_volts, 	1'000},
+	}}};
+	static mapped_registers<eastron_sunspec_mapping> mapped{};
+	static tracked_registers<eastron_sunspec_mapping> tracked{};
 	for (;;) {
-		int ms_s = time_us_64() / 1000;
 		// fetch values
-		e.read_remote(1, &halfs_eastron::phase_1_neutral_volts, &halfs_eastron::export_active_energy);
-		e.read_remote(1, &halfs_eastron::line_1_to_line_2_volts, &halfs_eastron::average_line_to_line_volts);
-
-		// write to sunspec modbus
-		{
-			scoped_lock lock{g::sunspec_mutex()};
-			s.write(e.read(&halfs_eastron::phase_1_neutral_volts), 	&halfs_sunspec::phvpha);
-			s.write(e.read(&halfs_eastron::phase_2_neutral_volts), 	&halfs_sunspec::phvphb);
-			s.write(e.read(&halfs_eastron::phase_3_neutral_volts), 	&halfs_sunspec::phvphc);
-			s.write(e.read(&halfs_eastron::phase_1_current), 	&halfs_sunspec::apha);
-			s.write(e.read(&halfs_eastron::phase_2_current), 	&halfs_sunspec::aphb);
-			s.write(e.read(&halfs_eastron::phase_3_current), 	&halfs_sunspec::aphc);
-			s.write(e.read(&halfs_eastron::phase_1_active_power), 	&halfs_sunspec::wpha);
-			s.write(e.read(&halfs_eastron::phase_2_active_power), 	&halfs_sunspec::wphb);
-			s.write(e.read(&halfs_eastron::phase_3_active_power), 	&halfs_sunspec::wphc);
-			s.write(e.read(&halfs_eastron::phase_1_apparent_power), &halfs_sunspec::vapha);
-			s.write(e.read(&halfs_eastron::phase_2_apparent_power), &halfs_sunspec::vaphb);
-			s.write(e.read(&halfs_eastron::phase_3_apparent_power), &halfs_sunspec::vaphc);
-			s.write(e.read(&halfs_eastron::phase_1_reactive_power), &halfs_sunspec::varpha);
-			s.write(e.read(&halfs_eastron::phase_2_reactive_power), &halfs_sunspec::varphb);
-			s.write(e.read(&halfs_eastron::phase_3_reactive_power), &halfs_sunspec::varphc);
-			s.write(e.read(&halfs_eastron::phase_1_power_factor), 	&halfs_sunspec::pfpha);
-			s.write(e.read(&halfs_eastron::phase_2_power_factor), 	&halfs_sunspec::pfphb);
-			s.write(e.read(&halfs_eastron::phase_3_power_factor), 	&halfs_sunspec::pfphc);
-			s.write(e.read(&halfs_eastron::line_1_to_line_2_volts), &halfs_sunspec::ppvphab);
-			s.write(e.read(&halfs_eastron::line_2_to_line_3_volts), &halfs_sunspec::ppvphbc);
-			s.write(e.read(&halfs_eastron::line_3_to_line_1_volts), &halfs_sunspec::ppvphca);
-
-			s.write(e.read(&halfs_eastron::average_line_to_neutral_volts), &halfs_sunspec::phv);
-			s.write(e.read(&halfs_eastron::average_line_current), 		&halfs_sunspec::a);
-			s.write(e.read(&halfs_eastron::total_system_power), 		&halfs_sunspec::w);
-			s.write(e.read(&halfs_eastron::total_system_volt_amps), 	&halfs_sunspec::va);
-			s.write(e.read(&halfs_eastron::total_system_VAr), 		&halfs_sunspec::var);
-			s.write(e.read(&halfs_eastron::total_system_power_factor), 	&halfs_sunspec::pf);
-			s.write(e.read(&halfs_eastron::frequency_of_supply_voltage), 	&halfs_sunspec::hz);
-			s.write(e.read(&halfs_eastron::average_line_to_line_volts), 	&halfs_sunspec::ppv);
-			s.write(e.read(&halfs_eastron::import_active_energy) * 1e3f, 	&halfs_sunspec::totwhimp);
-			s.write(e.read(&halfs_eastron::export_active_energy) * 1e3f, 	&halfs_sunspec::totwhexp);
+		if (0 == scheduler.poll(e, 1, time_us_64() / 1000)) {
+			vTaskDelay(1);
+			continue;
 		}
 
-		// wait remaining 250ms for next iteration
-		int ms_e = time_us_64() / 1000;
-		vTaskDelay(pdMS_TO_TICKS(std::max(0, 250 - (ms_e - ms_s))));
+		mapped.read_from(e);
+		tracked.update(mapped);
+		g::sunspec_values().publish(tracked);
+		g::history().add(mapped, time_s());
+		// one frame for all event and websocket subscribers instead of a request per dashboard
+		if (Webserver().event_subscribers() || Webserver().websocket_subscribers(int(websocket_topic::measurements))) {
+			static static_string<1024> event{};
+			event.clear();
+			event.append("data: ");
+			int json_size = append_measurements_json(event, mapped);
+			event.append("\n\n");
+			Webserver().publish_event(event.sv());
+			Webserver().publish_websocket(int(websocket_topic::measurements), event.sv().substr(6, json_size));
+		}
 	}
 }
 
 void sunspec_server_task(void *) {
 	LogInfo("Sunspec server task started");
+	ls::modbus_actor<sunspec_layout, tcp_io>& s = g::sunspec_modbus();
+	static tracked_registers<eastron_sunspec_mapping> tracked{}; // static, too big for the small task stack
+	uint32_t applied_seq{};
 	for (;;) {
-		g::sunspec_modbus().poll_update_state(std::chrono::milliseconds{1000});
+		// this task is the only one touching the sunspec registers, new values are taken over between requests
+		if (g::sunspec_values().sequence() != applied_seq) {
+			applied_seq = g::sunspec_values().read(tracked);
+			tracked.registers.write_to(s);
+		}
+		s.poll_update_state(std::chrono::milliseconds{50});
 	}
 }
 
@@ -132,12 +149,14 @@ void sunspec_server_task(void *) {
 void startup_task(void *) {
 	LogInfo("Starting initialization");
 	std::cout << "Starting initialization\n";
+	flash_log_t::Default().init(log_storage::Default());
+	flash_log_t::Default().append(flash_record_type::boot, record_time(), {});
 	get_netif();
 	lwip_init();
 	wifi_storage::Default().update_hostname();
 	Webserver().start();
 	g::eastron_modbus();
-	g::sunspec_mutex();
+	g::sunspec_values();
 	g::sunspec_modbus();
 	LogInfo("Initialization done");
 
@@ -146,6 +165,7 @@ void startup_task(void *) {
 	xTaskCreate(usb_comm_task, "usb_comm", 512, NULL, 1, NULL);	// usb task also has to be started only after cyw43 init as some wifi functions are available
 	xTaskCreate(wifi_search_task, "UpdateWifiThread", 512, NULL, 1, NULL);
 	xTaskCreate(sunspec_server_task, "SunspecServerTask", 256, NULL, 1, NULL);
+	xTaskCreate(persistent_storage_t::writer_task, "FlashWriter", 256, NULL, 1, NULL);
 	board_led_set(OFF);
 	update_meter_task(nullptr);
 }
@@ -5,6 +5,7 @@ err_t tcp_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err
 err_t tcp_server_sent(void *arg, struct tcp_pcb *tpcb, u16_t len);
 err_t tcp_server_poll(void *arg, struct tcp_pcb *tpcb);
 void tcp_server_err(void *arg, err_t err);
+err_t close_connection(tcp_io::connection &c);
 
 err_t tcp_server_accept (void *arg, struct tcp_pcb *client_pcb, err_t err) {
 	if (err != ERR_OK || client_pcb == NULL || arg == NULL) {
@@ -14,12 +15,15 @@ err_t tcp_server_accept (void *arg, struct tcp_pcb *client_pcb, err_t err) {
 
 	tcp_io &io = *(tcp_io*)arg;
 
-	if (!io.conns.push({.client_socket = client_pcb})) {
-		LogError("No free client spot");
-		return tcp_server_result(nullptr, ERR_ABRT, client_pcb);
+	tcp_io::connection *c = io.conns | find{&tcp_io::connection::client_socket, (struct tcp_pcb*)nullptr};
+	if (!c) {
+		c = &*std::ranges::max_element(io.conns, {}, [now = tcp_io::now_ms()](const tcp_io::connection &o) { return now - o.last_activity_ms; });
+		LogWarning("No free client spot, evicting least recently active client");
+		close_connection(*c);
 	}
+	*c = {.io = &io, .client_socket = client_pcb, .last_activity_ms = tcp_io::now_ms(), .generation = c->generation + 1};
 	
-	tcp_arg(client_pcb, arg);
+	tcp_arg(client_pcb, c);
 	tcp_sent(client_pcb, tcp_server_sent);
 	tcp_recv(client_pcb, tcp_server_recv);
 	tcp_poll(client_pcb, tcp_server_poll, 5 * 2);
@@ -31,20 +35,25 @@ err_t tcp_server_accept (void *arg, struct tcp_pcb *client_pcb, err_t err) {
 
 
 err_t tcp_server_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err) {
-	if (!p || !arg) {
+	if (!arg) {
 		LogError("tcp_server_recv() failed");
+		if (p)
+			pbuf_free(p);
 		return tcp_server_result(arg, -1, tpcb);
 	}
-	tcp_io &io = *(tcp_io*)arg;
-	tcp_io::connection *c = io.conns | find{&tcp_io::connection::client_socket, tpcb};
-	if (!c) {
-		LogError("Socket not found in conns");
-	} else if (p->tot_len > 0) {
-		for (uint16_t i: std::ranges::iota_view{uint16_t(0), p->tot_len})
-			c->buffer.push(pbuf_get_at(p, i));
-	}
-	pbuf_free(p);
-	xTaskNotifyGive(io.data_retrieve_wait);
+	tcp_io::connection &c = *(tcp_io::connection*)arg;
+	if (!p) // remote closed the connection
+		return close_connection(c);
+	if (c.rx_chain && c.rx_chain->tot_len + p->tot_len > tcp_io::MAX_QUEUED_BYTES)
+		return ERR_MEM; // lwip keeps the data and redelivers it once the queue was consumed
+	// the pbufs are chained up as they are, frames are only copied out once complete
+	if (c.rx_chain)
+		pbuf_cat(c.rx_chain, p);
+	else
+		c.rx_chain = p;
+	c.last_activity_ms = tcp_io::now_ms();
+	if (c.io->data_retrieve_wait)
+		xTaskNotifyGive(c.io->data_retrieve_wait);
 	return ERR_OK;
 }
 
@@ -53,24 +62,31 @@ err_t tcp_server_sent(void *arg, struct tcp_pcb *tpcb, u16_t len) {
 }
 
 err_t tcp_server_poll(void *arg, struct tcp_pcb *tpcb) {
-	tcp_io &io = *(tcp_io*)arg;
-	tcp_io::connection *c = io.conns | find{&tcp_io::connection::client_socket, tpcb};
-	err_t err = tcp_server_result(arg, -1, tpcb);
-	if (!c) {
+	if (!arg) {
 		LogError("Couldnt find connection with client socket");
-		return err;
+		return tcp_server_result(arg, -1, tpcb);
 	}
-	*c = *io.conns.pop();
-	return err;
+	tcp_io::connection &c = *(tcp_io::connection*)arg;
+	if (tcp_io::now_ms() - c.last_activity_ms < c.io->idle_timeout_ms)
+		return ERR_OK;
+	LogInfo("Closing idle sunspec modbus client");
+	return close_connection(c);
 }
 
 void tcp_server_err(void *arg, err_t err) {
 	LogError("sunspec modbus tcp_server_err {}", err);
-	if (err != ERR_ABRT) {
-		LogError("tcp_client_err_fn {}", err);
-		struct tcp_pcb *t{};
-		tcp_server_result(arg, err, t);
-	}
+	if (!arg)
+		return;
+	// the pcb is already freed by lwip, only the slot has to be released
+	tcp_io::connection &c = *(tcp_io::connection*)arg;
+	c.client_socket = nullptr;
+	c.release();
+}
+
+err_t close_connection(tcp_io::connection &c) {
+	err_t err = tcp_server_result(&c, -1, c.client_socket);
+	c.release();
+	return err;
 }
 
 err_t tcp_server_result(void *arg, int status, struct tcp_pcb *&client) {